@@ -15,13 +15,129 @@
  *    in one call;
  *  sleepy_mutex - a mutex to protect the fields of this structure;
  *  cdev - haracter device structure.
- *  sleep_time - timestamp when device went to sleep.
+ *  engine - wait queue and wake generation (see sleepy_core.h);
+ *  restart_lock - protects restarts;
+ *  restarts - sleeps interrupted by a signal, waiting to be resumed;
+ *  eventfds - registered sleepy_eventfds (under sleepy_mutex);
+ *  neventfds - how many there are;
+ *  triggers - sleepy_triggers from this device (under the module's
+ *    trigger mutex);
+ *  alarms - pending sleepy_alarms (under sleepy_mutex);
+ *  nalarms - how many there are;
+ *  next_alarm - handle of the next one scheduled;
+ *  sleepers - tasks inside a blocking sleep on the device;
+ *  drain_wq - SLEEPY_IOC_DRAIN callers wait here for sleepers to reach 0;
+ *  sleeper_lock - serializes changes to sleeper_list;
+ *  sleeper_list - sleepy_sleepers of those tasks, read under RCU;
+ *  events - netlink events waiting to be sent (see sleepy_nl.h).
  */
 struct sleepy_dev {
   unsigned char *data;
   struct mutex sleepy_mutex; 
   struct cdev cdev;
-  unsigned long flag;
-  wait_queue_head_t wq;
+  struct sleepy_engine engine;
+  spinlock_t restart_lock;
+  struct list_head restarts;
+  struct list_head eventfds;
+  unsigned int neventfds;
+  struct list_head triggers;
+  struct list_head alarms;
+  unsigned int nalarms;
+  u64 next_alarm;
+  atomic_t sleepers;
+  wait_queue_head_t drain_wq;
+  spinlock_t sleeper_lock;
+  struct list_head sleeper_list;
+  struct sleepy_nl_batch events;
+};
+
+/* A task inside a blocking sleep, as listed in debugfs.
+ *  link - position in sleepy_dev.sleeper_list;
+ *  rcu - frees it once no reader can still see it;
+ *  task - the sleeping task, named only when debugfs lists it;
+ *  chan - channel it sleeps on;
+ *  start - ktime_get_ns() when the sleep began;
+ *  deadline - when the sleep times out, in jiffies;
+ *  gen - generation of the channel that ends the sleep.
+ */
+struct sleepy_sleeper {
+  struct list_head link;
+  struct rcu_head rcu;
+  struct task_struct *task;
+  unsigned int chan;
+  u64 start;
+  unsigned long deadline;
+  u64 gen;
+};
+
+/* A sleep interrupted by a signal. The restarted write() (or ioctl) from
+ * the same task on the same file and channel resumes it with the
+ * deadline and generation it had, rather than starting over. A sequence
+ * wait ('seq' set) keeps only its deadline, as the generation it waits
+ * for comes with the call.
+ */
+struct sleepy_restart {
+  struct list_head link;
+  struct file *filp;
+  pid_t pid;
+  unsigned int chan;
+  int seconds;
+  int seq;
+  struct sleepy_wait wait;
+};
+
+/* An eventfd signalled on every new generation of the device.
+ *  watch - registration with the device engine;
+ *  link - position in sleepy_dev.eventfds;
+ *  ctx - the eventfd;
+ *  filp - open file it was registered through, which owns it.
+ */
+struct sleepy_eventfd {
+  struct sleepy_watch watch;
+  struct list_head link;
+  struct eventfd_ctx *ctx;
+  struct file *filp;
+};
+
+/* A trigger edge: every 'every'-th new generation of the device it
+ * leaves wakes device 'to', 'delay' jiffies later.
+ *  watch - registration with the engine of the device it leaves;
+ *  link - position in that device's triggers;
+ *  to - minor of the device to wake;
+ *  every, count - fire on every 'every'-th generation; 'count' seen
+ *    since it last fired, however many each wake or advance made
+ *    (under the engine lock);
+ *  delay - jiffies from firing to the wake;
+ *  value - wake value to pass on;
+ *  work - the pending wake.
+ */
+struct sleepy_trigger {
+  struct sleepy_watch watch;
+  struct list_head link;
+  unsigned int to;
+  unsigned int every;
+  unsigned int count;
+  unsigned long delay;
+  u64 value;
+  struct delayed_work work;
+};
+
+/* A wake scheduled with SLEEPY_IOC_WAKE_AT.
+ *  timer - fires at the requested time;
+ *  work - does the wake, which needs the engine lock;
+ *  link - position in sleepy_dev.alarms, empty once the alarm has fired
+ *    or been cancelled;
+ *  dev - device to wake;
+ *  handle - identifies it to SLEEPY_IOC_WAKE_CANCEL;
+ *  chan, value - channel to wake and value to hand over.
+ */
+struct sleepy_alarm {
+  struct hrtimer timer;
+  struct work_struct work;
+  struct list_head link;
+  struct sleepy_dev *dev;
+  u64 handle;
+  unsigned int chan;
+  u64 value;
 };
 #endif /* SLEEPY_H_1727_INCLUDED */
@@ -0,0 +1,216 @@
+/** microbenchmark for the sleepy wait engine, built against the
+ ** userspace shims so it can run under perf or valgrind
+ **
+ ** usage: sleepy_bench [-t threads] [-s seconds] [-q] [-x] [-p usecs]
+ **                     [-l|-L|-P]
+ **   -q  serve timeouts from the engine's deadline queue
+ **   -x  timeout storm: nobody wakes, sleepers time out every jiffy
+ **   -p  thread pool: a SEMAPHORE engine gets one job every 'usecs' and
+ **       each job wakes one worker; reports dispatch-to-run latency
+ **   -l  with -p, hand jobs to the most recently parked worker (LIFO)
+ **   -L  with -p, prefer workers parked on the dispatcher's CPU or node
+ **   -P  with -p, hand jobs to the highest-priority worker (PRIO); every
+ **       other worker runs at nice 5 so there is a difference to see **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "sleepy_core.h"
+
+static struct sleepy_engine engine;
+static atomic_int stop;
+static atomic_long wakeups;
+static atomic_long timeouts;
+static long sleep_jiffies = HZ;
+
+/* Thread pool mode: every job carries its dispatch time as the wake
+ * value and touches its worker's private working set */
+#define POOL_WORKSET (256 * 1024)
+static long pool_gap_us;
+static u64 *latencies;
+static atomic_long njobs;
+static long max_jobs;
+static atomic_int workers_used;
+static const char *policy_names[] = { "fifo", "lifo", "local", "prio" };
+
+static double
+now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+sleeper(void *arg)
+{
+  u64 value;
+  long r;
+
+  while (!atomic_load(&stop)) {
+    r = sleepy_engine_sleep(&engine, sleep_jiffies, &value);
+    if (r > 0)
+      atomic_fetch_add(&wakeups, 1);
+    else
+      atomic_fetch_add(&timeouts, 1);
+  }
+  return NULL;
+}
+
+static void *
+pool_worker(void *arg)
+{
+  unsigned char *set = calloc(1, POOL_WORKSET);
+  unsigned long sum = 0;
+  long jobs = 0, i, r;
+  u64 value;
+
+  if (engine.policy == SLEEPY_POLICY_PRIO && (uintptr_t)arg % 2)
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 5);
+
+  while (!atomic_load(&stop)) {
+    // Park for long enough that only jobs move workers around the queue
+    r = sleepy_engine_sleep(&engine, 10 * HZ, &value);
+    if (r <= 0 || value == 0)
+      continue;
+    i = atomic_fetch_add(&njobs, 1);
+    if (i < max_jobs)
+      latencies[i] = ktime_get_ns() - value;
+
+    // The job itself: a pass over this worker's data, which is only
+    // still cached if the worker ran recently
+    for (i = 0; i < POOL_WORKSET; i += 64)
+      sum += set[i]++;
+    if (jobs++ == 0)
+      atomic_fetch_add(&workers_used, 1);
+  }
+  free(set);
+  return (void *)(uintptr_t)sum;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+  u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(long n, double p)
+{
+  return n ? latencies[(long)((n - 1) * p)] / 1e3 : 0;
+}
+
+/* Dispatch jobs one at a time for 'seconds', then report the latency
+ * distribution */
+static void
+run_pool(int nthreads, double seconds)
+{
+  struct timespec gap = { 0, pool_gap_us * 1000 };
+  double start, elapsed;
+  long n;
+
+  max_jobs = (long)(seconds * 1e6 / pool_gap_us) + 1;
+  latencies = calloc(max_jobs, sizeof(*latencies));
+
+  start = now_sec();
+  while ((elapsed = now_sec() - start) < seconds) {
+    sleepy_engine_post(&engine, 1, ktime_get_ns());
+    nanosleep(&gap, NULL);
+  }
+
+  n = min(atomic_load(&njobs), max_jobs);
+  qsort(latencies, n, sizeof(*latencies), cmp_u64);
+  printf("workers=%d policy=%s jobs=%ld (%.0f/s) workers-used=%d "
+	 "latency-us p50=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+	 nthreads, policy_names[engine.policy],
+	 n, n / elapsed, atomic_load(&workers_used),
+	 percentile_us(n, 0.5), percentile_us(n, 0.99),
+	 percentile_us(n, 0.999), percentile_us(n, 1.0));
+}
+
+int main(int argc, char **argv) {
+  int nthreads = 8, storm = 0, c;
+  double seconds = 2.0;
+  pthread_t *threads;
+  long wakes = 0;
+  struct sleepy_timer_stats stats;
+  double start, elapsed;
+  int i;
+
+  sleepy_engine_init(&engine);
+  while ((c = getopt(argc, argv, "t:s:qxp:lLP")) != -1) {
+    switch (c) {
+    case 't': nthreads = atoi(optarg); break;
+    case 's': seconds = atof(optarg); break;
+    case 'q': sleepy_engine_set_timers(&engine, SLEEPY_TIMERS_QUEUE); break;
+    case 'x': storm = 1; sleep_jiffies = 1; break;
+    case 'p': pool_gap_us = atol(optarg); break;
+    case 'l': sleepy_engine_set_policy(&engine, SLEEPY_POLICY_LIFO); break;
+    case 'L': sleepy_engine_set_policy(&engine, SLEEPY_POLICY_LOCAL); break;
+    case 'P': sleepy_engine_set_policy(&engine, SLEEPY_POLICY_PRIO); break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-s seconds] [-q] [-x] "
+	      "[-p usecs] [-l|-L|-P]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  threads = calloc(nthreads, sizeof *threads);
+  if (pool_gap_us > 0) {
+    sleepy_engine_set_mode(&engine, SLEEPY_MODE_SEMAPHORE);
+    for (i = 0; i < nthreads; i++)
+      pthread_create(&threads[i], NULL, pool_worker, (void *)(uintptr_t)i);
+    run_pool(nthreads, seconds);
+
+    atomic_store(&stop, 1);
+    sleepy_engine_post(&engine, nthreads, 0);
+    for (i = 0; i < nthreads; i++)
+      pthread_join(threads[i], NULL);
+    sleepy_engine_destroy(&engine);
+    free(latencies);
+    free(threads);
+    return 0;
+  }
+
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, sleeper, NULL);
+
+  /* wake as fast as possible for the requested time, or just wait */
+  start = now_sec();
+  while ((elapsed = now_sec() - start) < seconds) {
+    if (storm) {
+      usleep(10000);
+      continue;
+    }
+    sleepy_engine_wake(&engine, 0);
+    wakes++;
+  }
+
+  atomic_store(&stop, 1);
+  sleepy_engine_wake(&engine, 0);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  printf("sleepers=%d wakes=%ld (%.0f/s) sleeper-wakeups=%ld (%.0f/s) "
+	 "timeouts=%ld (%.0f/s)\n",
+	 nthreads, wakes, wakes / elapsed,
+	 atomic_load(&wakeups), atomic_load(&wakeups) / elapsed,
+	 atomic_load(&timeouts), atomic_load(&timeouts) / elapsed);
+  sleepy_engine_timer_stats(&engine, &stats);
+  if (stats.expiries)
+    printf("queue-timer-expiries=%llu (%.0f/s)\n",
+	   (unsigned long long)stats.expiries, stats.expiries / elapsed);
+  sleepy_engine_destroy(&engine);
+  free(threads);
+  return 0;
+}
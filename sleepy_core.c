@@ -0,0 +1,1607 @@
+/* sleepy_core.c - wait/wake engine shared by the sleepy module and its
+ * userspace build. See sleepy_core.h.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>
+#endif
+#else
+#include <string.h>
+#endif
+
+#include "sleepy_core.h"
+
+/* ---------------------------------------------------------------- */
+/* Releases. Every sleep notes eng->released under the engine lock when it
+ * begins; a group wake or sleepy_engine_release() bumps it and wakes the
+ * engine's queues. */
+
+/* Has a release ended the sleep that noted 'rel'? */
+static int
+sleepy_released(struct sleepy_engine *eng, unsigned long rel)
+{
+  return READ_ONCE(eng->released) != rel;
+}
+
+/* Value of the latest release */
+static u64
+sleepy_release_value(struct sleepy_engine *eng)
+{
+  smp_rmb();
+  return READ_ONCE(eng->release_value);
+}
+
+/* ---------------------------------------------------------------- */
+/* Deadline queue: a binary min-heap of sleepers keyed by expiry, so that
+ * insert and cancel are O(log n), and a single hrtimer armed for the
+ * root. Cancelling the root does not re-arm the timer; the next expiry
+ * simply finds nothing due and re-arms for the new root. */
+
+static void
+sleepy_tq_set(struct sleepy_engine *eng, unsigned int idx,
+	      struct sleepy_waiter *w)
+{
+  eng->tq_heap[idx] = w;
+  w->heap_idx = idx;
+}
+
+static void
+sleepy_tq_sift_up(struct sleepy_engine *eng, unsigned int idx)
+{
+  struct sleepy_waiter *w = eng->tq_heap[idx];
+  unsigned int parent;
+
+  while (idx > 0) {
+    parent = (idx - 1) / 2;
+    if (eng->tq_heap[parent]->expires <= w->expires)
+      break;
+    sleepy_tq_set(eng, idx, eng->tq_heap[parent]);
+    idx = parent;
+  }
+  sleepy_tq_set(eng, idx, w);
+}
+
+static void
+sleepy_tq_sift_down(struct sleepy_engine *eng, unsigned int idx)
+{
+  struct sleepy_waiter *w = eng->tq_heap[idx];
+  unsigned int child;
+
+  for (;;) {
+    child = 2 * idx + 1;
+    if (child >= eng->tq_len)
+      break;
+    if (child + 1 < eng->tq_len &&
+	eng->tq_heap[child + 1]->expires < eng->tq_heap[child]->expires)
+      child++;
+    if (w->expires <= eng->tq_heap[child]->expires)
+      break;
+    sleepy_tq_set(eng, idx, eng->tq_heap[child]);
+    idx = child;
+  }
+  sleepy_tq_set(eng, idx, w);
+}
+
+/* Called with tq_lock held */
+static void
+sleepy_tq_remove(struct sleepy_engine *eng, struct sleepy_waiter *w)
+{
+  unsigned int idx = w->heap_idx;
+  struct sleepy_waiter *last;
+
+  w->heap_idx = SLEEPY_TQ_NONE;
+  last = eng->tq_heap[--eng->tq_len];
+  if (last == w)
+    return;
+  sleepy_tq_set(eng, idx, last);
+  sleepy_tq_sift_up(eng, idx);
+  sleepy_tq_sift_down(eng, last->heap_idx);
+}
+
+/* Time out every queued sleeper that is due and re-arm for the rest.
+ * Sleepers only return after taking tq_lock to leave the queue, so the
+ * ones woken here are still valid while we hold it. */
+static enum hrtimer_restart
+sleepy_tq_expire(struct hrtimer *timer)
+{
+  struct sleepy_engine *eng = container_of(timer, struct sleepy_engine,
+					   tq_timer);
+  enum hrtimer_restart restart = HRTIMER_NORESTART;
+  u64 now = ktime_get_ns();
+  struct sleepy_waiter *w;
+  unsigned long flags;
+
+  spin_lock_irqsave(&eng->tq_lock, flags);
+  eng->tq_expiries++;
+#ifdef __KERNEL__
+  if (smp_processor_id() == eng->timer_cpu)
+    eng->tq_hk_expiries++;
+#endif
+  while (eng->tq_len > 0 && eng->tq_heap[0]->expires <= now) {
+    w = eng->tq_heap[0];
+    sleepy_tq_remove(eng, w);
+    WRITE_ONCE(w->expired, 1);
+    wake_up_process(w->task);
+  }
+  if (eng->tq_len > 0) {
+    hrtimer_set_expires(timer, ns_to_ktime(eng->tq_heap[0]->expires));
+    restart = HRTIMER_RESTART;
+  }
+  spin_unlock_irqrestore(&eng->tq_lock, flags);
+  return restart;
+}
+
+#ifdef __KERNEL__
+/* Arm the timer for the current earliest expiry from the timer CPU, so
+ * that it is pinned there */
+static void
+sleepy_tq_arm_remote(struct work_struct *work)
+{
+  struct sleepy_engine *eng = container_of(work, struct sleepy_engine,
+					   tq_arm);
+  unsigned long flags;
+
+  spin_lock_irqsave(&eng->tq_lock, flags);
+  if (eng->tq_len > 0)
+    hrtimer_start(&eng->tq_timer, ns_to_ktime(eng->tq_heap[0]->expires),
+		  HRTIMER_MODE_ABS_PINNED);
+  spin_unlock_irqrestore(&eng->tq_lock, flags);
+}
+#endif
+
+/* Arm the timer for 'expires', the new earliest expiry: right here, or
+ * on the engine's timer CPU if it has one. Called with tq_lock held. */
+static void
+sleepy_tq_arm(struct sleepy_engine *eng, u64 expires)
+{
+#ifdef __KERNEL__
+  if (eng->timer_cpu >= 0) {
+    if (eng->timer_cpu != smp_processor_id()) {
+      queue_work_on(eng->timer_cpu, system_highpri_wq, &eng->tq_arm);
+      eng->tq_remote_arms++;
+    } else {
+      hrtimer_start(&eng->tq_timer, ns_to_ktime(expires),
+		    HRTIMER_MODE_ABS_PINNED);
+    }
+    return;
+  }
+#endif
+  hrtimer_start(&eng->tq_timer, ns_to_ktime(expires), HRTIMER_MODE_ABS);
+}
+
+/* Queue 'w', arming the timer if it is the new earliest expiry. The heap
+ * array is grown outside the spinlock. Returns 0 or -ENOMEM. */
+static int
+sleepy_tq_add(struct sleepy_engine *eng, struct sleepy_waiter *w)
+{
+  struct sleepy_waiter **heap, **old;
+  unsigned long flags;
+  unsigned int cap;
+
+  spin_lock_irqsave(&eng->tq_lock, flags);
+  while (eng->tq_len == eng->tq_cap) {
+    cap = eng->tq_cap ? eng->tq_cap * 2 : 64;
+    spin_unlock_irqrestore(&eng->tq_lock, flags);
+
+    heap = kvmalloc_array(cap, sizeof(*heap), GFP_KERNEL);
+    if (heap == NULL)
+      return -ENOMEM;
+
+    spin_lock_irqsave(&eng->tq_lock, flags);
+    old = heap;
+    if (eng->tq_cap < cap) {
+      if (eng->tq_len)
+	memcpy(heap, eng->tq_heap, eng->tq_len * sizeof(*heap));
+      old = eng->tq_heap;
+      eng->tq_heap = heap;
+      eng->tq_cap = cap;
+    }
+    spin_unlock_irqrestore(&eng->tq_lock, flags);
+    kvfree(old);
+    spin_lock_irqsave(&eng->tq_lock, flags);
+  }
+
+  w->expired = 0;
+  eng->tq_heap[eng->tq_len++] = w;
+  sleepy_tq_sift_up(eng, eng->tq_len - 1);
+  if (w->heap_idx == 0)
+    sleepy_tq_arm(eng, w->expires);
+  spin_unlock_irqrestore(&eng->tq_lock, flags);
+  return 0;
+}
+
+/* Take 'w' off the queue unless the timer already did */
+static void
+sleepy_tq_del(struct sleepy_engine *eng, struct sleepy_waiter *w)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&eng->tq_lock, flags);
+  if (w->heap_idx != SLEEPY_TQ_NONE)
+    sleepy_tq_remove(eng, w);
+  spin_unlock_irqrestore(&eng->tq_lock, flags);
+}
+
+/* Has generation 'flag' reached 'target'? Both may have wrapped. */
+static int
+sleepy_seq_reached(unsigned long flag, unsigned long target)
+{
+  return (long)(flag - target) >= 0;
+}
+
+/* wait_event_interruptible_timeout() for generation '*flagp' to reach
+ * 'target', with the timeout served by the deadline queue rather than a
+ * timer of our own. Same return convention. */
+static long
+sleepy_tq_wait(struct sleepy_engine *eng, wait_queue_head_t *wq,
+	       unsigned long *flagp, unsigned long target, unsigned long rel,
+	       long timeout)
+{
+  unsigned long end = jiffies + timeout;
+  struct sleepy_waiter w;
+  long ret, left;
+
+  if (timeout <= 0)
+    return sleepy_seq_reached(READ_ONCE(*flagp), target) ||
+	   sleepy_released(eng, rel);
+
+  w.task = current;
+  w.expires = ktime_get_ns() + jiffies_to_nsecs(timeout);
+  if (sleepy_tq_add(eng, &w))
+    return wait_event_interruptible_timeout(*wq,
+					    sleepy_seq_reached(READ_ONCE(*flagp),
+							       target) ||
+					    sleepy_released(eng, rel),
+					    timeout);
+
+  ret = wait_event_interruptible(*wq,
+				 sleepy_seq_reached(READ_ONCE(*flagp),
+						    target) ||
+				 sleepy_released(eng, rel) ||
+				 READ_ONCE(w.expired));
+  sleepy_tq_del(eng, &w);
+
+  if (ret)
+    return ret;
+  if (sleepy_seq_reached(READ_ONCE(*flagp), target) ||
+      sleepy_released(eng, rel)) {
+    left = (long)(end - jiffies);
+    return left > 0 ? left : 1;
+  }
+  return 0;
+}
+
+/* Do this engine's sleeps time out on the deadline queue? A timer CPU
+ * only helps if they do. Called with eng->lock held. */
+static int
+sleepy_engine_queued(struct sleepy_engine *eng)
+{
+  return eng->timers == SLEEPY_TIMERS_QUEUE || eng->timer_cpu >= 0;
+}
+
+/* Sleep on 'wq' until generation '*flagp' reaches 'target' or the engine
+ * is released, on the deadline queue if 'queued'. Same return convention
+ * as wait_event_interruptible_timeout(). */
+static long
+sleepy_engine_park(struct sleepy_engine *eng, wait_queue_head_t *wq,
+		   unsigned long *flagp, unsigned long target,
+		   unsigned long rel, int queued, long timeout)
+{
+  if (queued)
+    return sleepy_tq_wait(eng, wq, flagp, target, rel, timeout);
+  return wait_event_interruptible_timeout(*wq,
+					  sleepy_seq_reached(READ_ONCE(*flagp),
+							     target) ||
+					  sleepy_released(eng, rel),
+					  timeout);
+}
+
+/* ---------------------------------------------------------------- */
+/* NUMA. Broadcast sleepers park on their node's wait queue and exclusive
+ * sleepers are also listed per node, so a wake can stay on the waker's
+ * node and remote nodes can be woken by a helper running there, rather
+ * than by one CPU sending every IPI across the interconnect. */
+
+#ifdef CONFIG_NUMA
+static void
+sleepy_node_wake(struct work_struct *work)
+{
+  struct sleepy_node *node = container_of(work, struct sleepy_node, wake);
+
+  wake_up_interruptible(&node->wq);
+}
+
+static void
+sleepy_engine_init_nodes(struct sleepy_engine *eng)
+{
+  int n;
+
+  // Without the array everyone shares eng->wq, as on a single node
+  eng->nodes = kcalloc(nr_node_ids, sizeof(*eng->nodes), GFP_KERNEL);
+  if (eng->nodes == NULL)
+    return;
+  for (n = 0; n < nr_node_ids; n++) {
+    init_waitqueue_head(&eng->nodes[n].wq);
+    INIT_LIST_HEAD(&eng->nodes[n].waiters);
+    INIT_WORK(&eng->nodes[n].wake, sleepy_node_wake);
+  }
+}
+
+static void
+sleepy_engine_destroy_nodes(struct sleepy_engine *eng)
+{
+  int n;
+
+  if (eng->nodes == NULL)
+    return;
+  for (n = 0; n < nr_node_ids; n++)
+    cancel_work_sync(&eng->nodes[n].wake);
+  kfree(eng->nodes);
+  eng->nodes = NULL;
+}
+#endif
+
+/* The queue a broadcast sleeper running here parks on */
+static wait_queue_head_t *
+sleepy_engine_wq(struct sleepy_engine *eng)
+{
+#ifdef CONFIG_NUMA
+  if (eng->nodes)
+    return &eng->nodes[numa_node_id()].wq;
+#endif
+  return &eng->wq;
+}
+
+/* Wake every broadcast sleeper: those on this node directly, those on
+ * other nodes through their node's helper. */
+static void
+sleepy_engine_wake_all(struct sleepy_engine *eng)
+{
+#ifdef CONFIG_NUMA
+  int n, local, cpu;
+
+  if (eng->nodes) {
+    // Order the new flag before looking for sleepers; pairs with the
+    // barrier in set_current_state() on the sleeping side
+    smp_mb();
+    local = numa_node_id();
+    for (n = 0; n < nr_node_ids; n++) {
+      if (!waitqueue_active(&eng->nodes[n].wq))
+	continue;
+      cpu = cpumask_any_and(cpumask_of_node(n), cpu_online_mask);
+      if (n == local || cpu >= nr_cpu_ids)
+	wake_up_interruptible(&eng->nodes[n].wq);
+      else
+	queue_work_on(cpu, system_highpri_wq, &eng->nodes[n].wake);
+    }
+    return;
+  }
+#endif
+  wake_up_interruptible(&eng->wq);
+}
+
+/* Scheduling priority of the current task, lower being more urgent */
+static int
+sleepy_current_prio(void)
+{
+#ifdef __KERNEL__
+  return current->prio;
+#else
+  return sleepy_user_prio();
+#endif
+}
+
+/* Insert 'w' into 'head' behind every waiter of the same or more urgent
+ * priority, keeping 'head' sorted and arrival-ordered within a priority.
+ * Newcomers are usually the least urgent, so search from the tail. */
+static void
+sleepy_prio_insert(struct list_head *head, struct sleepy_waiter *w)
+{
+  struct list_head *pos;
+
+  for (pos = head->prev; pos != head; pos = pos->prev)
+    if (list_entry(pos, struct sleepy_waiter, link)->prio <= w->prio)
+      break;
+  list_add(&w->link, pos);
+}
+
+/* Under SLEEPY_POLICY_PRIO, list a broadcast sleeper of channel 'chan'
+ * in eng->sleepers so that wakes reach it in priority order. Returns
+ * whether it was listed. Called with eng->lock held. */
+static int
+sleepy_prio_enter(struct sleepy_engine *eng, struct sleepy_waiter *w,
+		  unsigned int chan)
+{
+  if (eng->policy != SLEEPY_POLICY_PRIO)
+    return 0;
+  w->task = current;
+  w->prio = sleepy_current_prio();
+  w->chan = chan;
+  sleepy_prio_insert(&eng->sleepers, w);
+  return 1;
+}
+
+static void
+sleepy_prio_leave(struct sleepy_engine *eng, struct sleepy_waiter *w)
+{
+  mutex_lock(&eng->lock);
+  list_del(&w->link);
+  mutex_unlock(&eng->lock);
+}
+
+/* Wake the listed sleepers of channel 'chan', most urgent first; the
+ * broadcast that follows finds them already running. Called with
+ * eng->lock held. */
+static void
+sleepy_prio_wake(struct sleepy_engine *eng, unsigned int chan)
+{
+  struct sleepy_waiter *w;
+
+  list_for_each_entry(w, &eng->sleepers, link)
+    if (w->chan == chan)
+      wake_up_process(w->task);
+}
+
+/* Queue an exclusive sleeper at the tail (or in priority order under
+ * SLEEPY_POLICY_PRIO), noting where it parked */
+static void
+sleepy_waiter_enqueue(struct sleepy_engine *eng, struct sleepy_waiter *w)
+{
+  w->cpu = raw_smp_processor_id();
+  w->node = cpu_to_node(w->cpu);
+  w->prio = sleepy_current_prio();
+  if (eng->policy == SLEEPY_POLICY_PRIO)
+    sleepy_prio_insert(&eng->waiters, w);
+  else
+    list_add_tail(&w->link, &eng->waiters);
+  INIT_LIST_HEAD(&w->nlink);
+#ifdef CONFIG_NUMA
+  if (eng->nodes)
+    list_add_tail(&w->nlink, &eng->nodes[w->node].waiters);
+#endif
+}
+
+static void
+sleepy_waiter_dequeue(struct sleepy_waiter *w)
+{
+  list_del_init(&w->link);
+  list_del_init(&w->nlink);
+}
+
+/* How far down a queue SLEEPY_POLICY_LOCAL looks for a sleeper that
+ * parked on the waker's CPU */
+#define SLEEPY_LOCAL_SCAN 16
+
+/* The waiter a SEMAPHORE permit goes to under the engine's policy.
+ * Called with eng->lock held and waiters not empty. */
+static struct sleepy_waiter *
+sleepy_engine_pick(struct sleepy_engine *eng)
+{
+  struct sleepy_waiter *w;
+  int cpu, scanned = 0;
+
+  // PRIO keeps the queue sorted, most urgent first
+  if (eng->policy == SLEEPY_POLICY_LIFO)
+    return list_last_entry(&eng->waiters, struct sleepy_waiter, link);
+  if (eng->policy != SLEEPY_POLICY_LOCAL)
+    return list_first_entry(&eng->waiters, struct sleepy_waiter, link);
+
+  cpu = raw_smp_processor_id();
+#ifdef CONFIG_NUMA
+  if (eng->nodes) {
+    struct list_head *local = &eng->nodes[cpu_to_node(cpu)].waiters;
+
+    list_for_each_entry(w, local, nlink) {
+      if (w->cpu == cpu)
+	return w;
+      if (++scanned == SLEEPY_LOCAL_SCAN)
+	break;
+    }
+    if (!list_empty(local))
+      return list_first_entry(local, struct sleepy_waiter, nlink);
+    return list_first_entry(&eng->waiters, struct sleepy_waiter, link);
+  }
+#endif
+  list_for_each_entry(w, &eng->waiters, link) {
+    if (w->cpu == cpu)
+      return w;
+    if (++scanned == SLEEPY_LOCAL_SCAN)
+      break;
+  }
+  return list_first_entry(&eng->waiters, struct sleepy_waiter, link);
+}
+
+void
+sleepy_engine_init(struct sleepy_engine *eng)
+{
+  mutex_init(&eng->lock);
+  init_waitqueue_head(&eng->wq);
+  eng->flag = 0;
+  memset(eng->values, 0, sizeof(eng->values));
+  eng->mode = SLEEPY_MODE_EDGE;
+  eng->signaled = 0;
+  eng->parties = 1;
+  eng->arrived = 0;
+  eng->permits = 0;
+  INIT_LIST_HEAD(&eng->waiters);
+  eng->policy = SLEEPY_POLICY_FIFO;
+  INIT_LIST_HEAD(&eng->sleepers);
+  eng->rate = 1;
+  eng->burst = 1;
+  eng->tokens = NSEC_PER_SEC;
+  eng->stamp = ktime_get_ns();
+  eng->timers = SLEEPY_TIMERS_SLEEPER;
+  spin_lock_init(&eng->tq_lock);
+  eng->tq_heap = NULL;
+  eng->tq_len = 0;
+  eng->tq_cap = 0;
+  hrtimer_init(&eng->tq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  eng->tq_timer.function = sleepy_tq_expire;
+  eng->timer_cpu = -1;
+  eng->tq_expiries = 0;
+  eng->tq_hk_expiries = 0;
+  eng->tq_remote_arms = 0;
+#ifdef __KERNEL__
+  INIT_WORK(&eng->tq_arm, sleepy_tq_arm_remote);
+#endif
+  INIT_LIST_HEAD(&eng->watches);
+  eng->chans = NULL;
+  eng->groups = NULL;
+  eng->group = 0;
+  INIT_LIST_HEAD(&eng->g0link);
+  INIT_LIST_HEAD(&eng->glink);
+  eng->released = 0;
+  eng->release_value = 0;
+#ifdef CONFIG_NUMA
+  sleepy_engine_init_nodes(eng);
+#endif
+}
+
+void
+sleepy_engine_destroy(struct sleepy_engine *eng)
+{
+  if (eng->groups) {
+    mutex_lock(&eng->groups->lock);
+    list_del_init(&eng->g0link);
+    list_del_init(&eng->glink);
+    mutex_unlock(&eng->groups->lock);
+    eng->groups = NULL;
+  }
+#ifdef __KERNEL__
+  cancel_work_sync(&eng->tq_arm);
+#endif
+  hrtimer_cancel(&eng->tq_timer);
+#ifdef CONFIG_NUMA
+  sleepy_engine_destroy_nodes(eng);
+#endif
+  kvfree(eng->tq_heap);
+  eng->tq_heap = NULL;
+  eng->tq_cap = 0;
+  kvfree(eng->chans);
+  eng->chans = NULL;
+}
+
+int
+sleepy_engine_set_timers(struct sleepy_engine *eng, int timers)
+{
+  if (timers != SLEEPY_TIMERS_SLEEPER && timers != SLEEPY_TIMERS_QUEUE)
+    return -EINVAL;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  eng->timers = timers;
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+int
+sleepy_engine_set_timer_cpu(struct sleepy_engine *eng, int cpu)
+{
+#ifdef __KERNEL__
+  if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))
+    return -EINVAL;
+#endif
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  eng->timer_cpu = cpu < 0 ? -1 : cpu;
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+void
+sleepy_engine_timer_stats(struct sleepy_engine *eng,
+			  struct sleepy_timer_stats *st)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&eng->tq_lock, flags);
+  st->expiries = eng->tq_expiries;
+  st->housekeeping = eng->tq_hk_expiries;
+  st->remote_arms = eng->tq_remote_arms;
+  spin_unlock_irqrestore(&eng->tq_lock, flags);
+}
+
+/* Move the generation on by 'n' (at least 1) carrying 'value' and wake
+ * its sleepers once. Called with eng->lock held. */
+static void
+sleepy_engine_advance(struct sleepy_engine *eng, unsigned long n, u64 value)
+{
+  struct sleepy_watch *w, *tmp;
+  unsigned long i;
+
+  // Publish the value before the generation that carries it, in every
+  // slot a sleeper of the skipped generations might look at
+  for (i = 1; i <= min_t(unsigned long, n, SLEEPY_WAKE_VALUES); i++)
+    eng->values[(eng->flag + i) % SLEEPY_WAKE_VALUES] = value;
+  smp_wmb();
+
+  // Advance condition flag and wake up sleeping processes in the queue
+  WRITE_ONCE(eng->flag, eng->flag + n);
+
+  // Under PRIO, the most urgent sleepers first
+  sleepy_prio_wake(eng, 0);
+  sleepy_engine_wake_all(eng);
+
+  // Tell the watchers, dropping those that are done
+  list_for_each_entry_safe(w, tmp, &eng->watches, link) {
+    if (w->notify(w, eng->flag, value))
+      list_del_init(&w->link);
+    w->flag = eng->flag;
+  }
+
+  // Latch the wake for whoever arrives before the next reset
+  if (eng->mode == SLEEPY_MODE_LATCHED)
+    eng->signaled = 1;
+
+  // Every wake, tripped or forced, starts a fresh barrier phase
+  eng->arrived = 0;
+}
+
+/* Hand one permit to 'w', which must still be queued. The waiter only
+ * returns after retaking eng->lock, so w and its task stay valid for the
+ * whole call. Called with eng->lock held. */
+static void
+sleepy_engine_grant(struct sleepy_waiter *w, u64 value)
+{
+  sleepy_waiter_dequeue(w);
+  w->value = value;
+  WRITE_ONCE(w->granted, 1);
+  wake_up_process(w->task);
+}
+
+/* ---------------------------------------------------------------- */
+/* RATELIMIT mode. Tokens are counted in 1/NSEC_PER_SEC units so that a
+ * refill is just elapsed nanoseconds times the rate. Rather than a timer
+ * topping the bucket up, it is refilled lazily whenever someone looks at
+ * it, and only the oldest waiter sleeps on the clock until its token is
+ * due; everyone behind it waits for a direct grant. */
+
+/* Called with eng->lock held */
+static void
+sleepy_engine_refill(struct sleepy_engine *eng)
+{
+  u64 now = ktime_get_ns();
+  u64 elapsed = now - eng->stamp;
+  u64 cap = (u64)eng->burst * NSEC_PER_SEC;
+
+  eng->stamp = now;
+  if (eng->tokens >= cap)
+    return;
+
+  // Past the time needed to fill the bucket, elapsed * rate could overflow
+  if (elapsed >= div64_u64(cap - eng->tokens, eng->rate))
+    eng->tokens = cap;
+  else
+    eng->tokens += elapsed * eng->rate;
+}
+
+/* Refill, hand whole tokens to waiters oldest first, and wake the new
+ * oldest waiter so it times the next token. Called with eng->lock held. */
+static void
+sleepy_engine_refill_grant(struct sleepy_engine *eng)
+{
+  struct sleepy_waiter *w;
+
+  sleepy_engine_refill(eng);
+  while (eng->tokens >= NSEC_PER_SEC && !list_empty(&eng->waiters)) {
+    w = list_first_entry(&eng->waiters, struct sleepy_waiter, link);
+    sleepy_engine_grant(w, 0);
+    eng->tokens -= NSEC_PER_SEC;
+  }
+  if (!list_empty(&eng->waiters)) {
+    w = list_first_entry(&eng->waiters, struct sleepy_waiter, link);
+    wake_up_process(w->task);
+  }
+}
+
+/* Jiffies until the bucket holds a whole token. Called with eng->lock
+ * held, right after a refill. */
+static long
+sleepy_engine_token_wait(struct sleepy_engine *eng)
+{
+  u64 ns;
+
+  if (eng->tokens >= NSEC_PER_SEC)
+    return 0;
+  ns = div64_u64(NSEC_PER_SEC - eng->tokens + eng->rate - 1, eng->rate);
+  return nsecs_to_jiffies(ns) + 1;
+}
+
+int
+sleepy_engine_set_rate(struct sleepy_engine *eng, u32 rate, u32 burst)
+{
+  if (rate == 0)
+    return -EINVAL;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  eng->rate = rate;
+  eng->burst = burst ? burst : 1;
+  eng->tokens = (u64)eng->burst * NSEC_PER_SEC;
+  eng->stamp = ktime_get_ns();
+  if (eng->mode == SLEEPY_MODE_RATELIMIT)
+    sleepy_engine_refill_grant(eng);
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+/* RATELIMIT mode sleep: take a token, queueing for one if needed.
+ * Called with eng->lock held, which it releases. */
+static long
+sleepy_engine_throttle(struct sleepy_engine *eng, long timeout, u64 *value)
+{
+  unsigned long end = jiffies + timeout;
+  unsigned long rel;
+  struct sleepy_waiter w;
+  long left = timeout;
+  long nap, ret;
+  int grouped;
+
+  *value = 0;
+
+  // Take a token straight away unless others are queued for one
+  sleepy_engine_refill(eng);
+  if (eng->tokens >= NSEC_PER_SEC && list_empty(&eng->waiters)) {
+    eng->tokens -= NSEC_PER_SEC;
+    mutex_unlock(&eng->lock);
+    return timeout > 0 ? timeout : 1;
+  }
+
+  w.task = current;
+  w.granted = 0;
+  w.value = 0;
+  sleepy_waiter_enqueue(eng, &w);
+  rel = eng->released;
+
+  for (;;) {
+    // Only the oldest waiter watches the clock
+    nap = left;
+    if (list_first_entry(&eng->waiters, struct sleepy_waiter, link) == &w)
+      nap = min(nap, sleepy_engine_token_wait(eng));
+
+    // Set our state before dropping the lock so a grant or a "you are
+    // now first" wake in between is not lost
+    set_current_state(TASK_INTERRUPTIBLE);
+    mutex_unlock(&eng->lock);
+    if (!READ_ONCE(w.granted) && !sleepy_released(eng, rel) &&
+	!signal_pending(current) && left > 0)
+      schedule_timeout(nap);
+    __set_current_state(TASK_RUNNING);
+    mutex_lock(&eng->lock);
+
+    if (!w.granted)
+      sleepy_engine_refill_grant(eng);
+    if (w.granted) {
+      left = (long)(end - jiffies);
+      ret = left > 0 ? left : 1;
+      break;
+    }
+
+    left = (long)(end - jiffies);
+    if (left < 0)
+      left = 0;
+    grouped = sleepy_released(eng, rel);
+    if (grouped || signal_pending(current) || left == 0) {
+      if (grouped) {
+	ret = left > 0 ? left : 1;
+	*value = sleepy_release_value(eng);
+      } else {
+	ret = signal_pending(current) ? -ERESTARTSYS : 0;
+      }
+      sleepy_waiter_dequeue(&w);
+
+      // If we were timing the next token, pass that job on
+      if (!list_empty(&eng->waiters))
+	wake_up_process(list_first_entry(&eng->waiters,
+					 struct sleepy_waiter, link)->task);
+      break;
+    }
+  }
+  mutex_unlock(&eng->lock);
+  return ret;
+}
+
+/* ---------------------------------------------------------------- */
+
+int
+sleepy_engine_post(struct sleepy_engine *eng, unsigned long count,
+		   u64 value)
+{
+  struct sleepy_waiter *w;
+
+  // Acquire mutex to access device state
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+
+  if (eng->mode == SLEEPY_MODE_SEMAPHORE) {
+    // Wake exactly as many waiters as there are permits, in the order
+    // the policy says
+    eng->permits += min(count, ULONG_MAX - eng->permits);
+    while (eng->permits > 0 && !list_empty(&eng->waiters)) {
+      w = sleepy_engine_pick(eng);
+      sleepy_engine_grant(w, value);
+      eng->permits--;
+    }
+  } else if (eng->mode == SLEEPY_MODE_RATELIMIT) {
+    // Extra tokens, capped at the bucket size like any refill
+    sleepy_engine_refill(eng);
+    eng->tokens += min_t(u64, count, eng->burst) * NSEC_PER_SEC;
+    eng->tokens = min_t(u64, eng->tokens, (u64)eng->burst * NSEC_PER_SEC);
+    sleepy_engine_refill_grant(eng);
+  } else {
+    sleepy_engine_advance(eng, 1, value);
+  }
+
+  // Release mutex on device state
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+int
+sleepy_engine_wake(struct sleepy_engine *eng, u64 value)
+{
+  return sleepy_engine_post(eng, 1, value);
+}
+
+int
+sleepy_engine_set_policy(struct sleepy_engine *eng, int policy)
+{
+  struct sleepy_waiter *w, *tmp;
+  struct list_head queued;
+
+  if (policy != SLEEPY_POLICY_FIFO && policy != SLEEPY_POLICY_LIFO &&
+      policy != SLEEPY_POLICY_LOCAL && policy != SLEEPY_POLICY_PRIO)
+    return -EINVAL;
+
+  INIT_LIST_HEAD(&queued);
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  // Sort whoever is already queued; leaving PRIO keeps the order as is
+  if (policy == SLEEPY_POLICY_PRIO && eng->policy != policy) {
+    list_splice_init(&eng->waiters, &queued);
+    list_for_each_entry_safe(w, tmp, &queued, link)
+      sleepy_prio_insert(&eng->waiters, w);
+  }
+  eng->policy = policy;
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+int
+sleepy_engine_watch(struct sleepy_engine *eng, struct sleepy_watch *w)
+{
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  w->flag = eng->flag;
+  list_add_tail(&w->link, &eng->watches);
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+void
+sleepy_engine_unwatch(struct sleepy_engine *eng, struct sleepy_watch *w)
+{
+  // Taking the lock also waits out a notify call in progress
+  mutex_lock(&eng->lock);
+  list_del_init(&w->link);
+  mutex_unlock(&eng->lock);
+}
+
+int
+sleepy_engine_set_mode(struct sleepy_engine *eng, int mode)
+{
+  struct sleepy_waiter *w, *tmp;
+
+  if (mode != SLEEPY_MODE_EDGE && mode != SLEEPY_MODE_LATCHED &&
+      mode != SLEEPY_MODE_BARRIER && mode != SLEEPY_MODE_SEMAPHORE &&
+      mode != SLEEPY_MODE_RATELIMIT)
+    return -EINVAL;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+
+  // Release anyone parked under the old mode's rules before switching
+  if (eng->mode != mode && eng->arrived > 0)
+    sleepy_engine_advance(eng, 1, 0);
+  if (eng->mode != mode) {
+    list_for_each_entry_safe(w, tmp, &eng->waiters, link)
+      sleepy_engine_grant(w, 0);
+    eng->permits = 0;
+    eng->tokens = (u64)eng->burst * NSEC_PER_SEC;
+    eng->stamp = ktime_get_ns();
+  }
+  eng->mode = mode;
+  eng->signaled = 0;
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+int
+sleepy_engine_set_parties(struct sleepy_engine *eng, unsigned int parties)
+{
+  if (parties == 0)
+    return -EINVAL;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  eng->parties = parties;
+
+  // Shrinking the party count may complete the current phase
+  if (eng->mode == SLEEPY_MODE_BARRIER && eng->arrived >= parties)
+    sleepy_engine_advance(eng, 1, 0);
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+int
+sleepy_engine_reset(struct sleepy_engine *eng)
+{
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  eng->signaled = 0;
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+/* Release every current sleeper of the engine: bump 'released', which
+ * each of them checks, and wake the engine's own queues. Sleepers only
+ * note 'released' under eng->lock, so none can slip past. Called with
+ * eng->lock held. */
+static void
+sleepy_engine_release_locked(struct sleepy_engine *eng, u64 value)
+{
+  struct sleepy_chans *tbl = eng->chans;
+  struct sleepy_waiter *w;
+  int i;
+
+  eng->release_value = value;
+  smp_wmb();
+  WRITE_ONCE(eng->released, eng->released + 1);
+
+  // SEMAPHORE and RATELIMIT sleepers wait for a direct wake
+  list_for_each_entry(w, &eng->waiters, link)
+    wake_up_process(w->task);
+  list_for_each_entry(w, &eng->sleepers, link)
+    wake_up_process(w->task);
+  sleepy_engine_wake_all(eng);
+  if (tbl) {
+    // Pairs with the barrier in prepare_to_wait() on the sleeping side
+    smp_mb();
+    for (i = 0; i < SLEEPY_CHAN_WQS; i++)
+      if (waitqueue_active(&tbl->wq[i]))
+	wake_up_interruptible(&tbl->wq[i]);
+  }
+}
+
+int
+sleepy_engine_release(struct sleepy_engine *eng, u64 value)
+{
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  sleepy_engine_release_locked(eng, value);
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* Groups. A group wake walks the group's member engines, not their
+ * sleepers, and releases each of them like sleepy_engine_release(), so
+ * a sleep only ever looks at its own engine. */
+
+void
+sleepy_groups_init(struct sleepy_groups *g)
+{
+  int i;
+
+  mutex_init(&g->lock);
+  for (i = 0; i < SLEEPY_GROUPS; i++)
+    INIT_LIST_HEAD(&g->members[i]);
+}
+
+int
+sleepy_groups_wake(struct sleepy_groups *g, unsigned int group, u64 value,
+		   void (*woken)(struct sleepy_engine *eng, u64 value))
+{
+  struct sleepy_engine *eng;
+
+  if (group >= SLEEPY_GROUPS)
+    return -EINVAL;
+
+  if (mutex_lock_killable(&g->lock))
+    return -EINTR;
+  if (group == 0) {
+    list_for_each_entry(eng, &g->members[0], g0link) {
+      mutex_lock(&eng->lock);
+      sleepy_engine_release_locked(eng, value);
+      mutex_unlock(&eng->lock);
+      if (woken)
+	woken(eng, value);
+    }
+  } else {
+    list_for_each_entry(eng, &g->members[group], glink) {
+      mutex_lock(&eng->lock);
+      sleepy_engine_release_locked(eng, value);
+      mutex_unlock(&eng->lock);
+      if (woken)
+	woken(eng, value);
+    }
+  }
+  mutex_unlock(&g->lock);
+  return 0;
+}
+
+void
+sleepy_engine_set_groups(struct sleepy_engine *eng,
+			 struct sleepy_groups *groups)
+{
+  eng->groups = groups;
+  eng->group = 0;
+  mutex_lock(&groups->lock);
+  list_add_tail(&eng->g0link, &groups->members[0]);
+  mutex_unlock(&groups->lock);
+}
+
+int
+sleepy_engine_set_group(struct sleepy_engine *eng, unsigned int group)
+{
+  struct sleepy_groups *g = eng->groups;
+
+  if (g == NULL || group >= SLEEPY_GROUPS)
+    return -EINVAL;
+
+  if (mutex_lock_killable(&g->lock))
+    return -EINTR;
+  list_del_init(&eng->glink);
+  if (group)
+    list_add_tail(&eng->glink, &g->members[group]);
+  eng->group = group;
+  mutex_unlock(&g->lock);
+  return 0;
+}
+
+/* Value of the first wake after generation 'flag', read without the
+ * lock: the slot is only trusted if no wake since could have reused it. */
+static u64
+sleepy_engine_value(struct sleepy_engine *eng, unsigned long flag)
+{
+  u64 value;
+
+  smp_rmb();
+  value = READ_ONCE(eng->values[(flag + 1) % SLEEPY_WAKE_VALUES]);
+  smp_rmb();
+  if (READ_ONCE(eng->flag) - flag < SLEEPY_WAKE_VALUES)
+    return value;
+
+  // Fell too far behind; settle for the newest value
+  mutex_lock(&eng->lock);
+  value = eng->values[eng->flag % SLEEPY_WAKE_VALUES];
+  mutex_unlock(&eng->lock);
+  return value;
+}
+
+/* SEMAPHORE mode sleep: take a permit, queueing for one if needed.
+ * Called with eng->lock held, which it releases. */
+static long
+sleepy_engine_acquire(struct sleepy_engine *eng, long timeout, u64 *value)
+{
+  unsigned long rel;
+  struct sleepy_waiter w;
+  long ret = timeout;
+  int grouped = 0;
+
+  // Take a free permit straight away unless others are queued for one
+  if (eng->permits > 0 && list_empty(&eng->waiters)) {
+    eng->permits--;
+    mutex_unlock(&eng->lock);
+    *value = 0;
+    return timeout > 0 ? timeout : 1;
+  }
+
+  w.task = current;
+  w.granted = 0;
+  w.value = 0;
+  sleepy_waiter_enqueue(eng, &w);
+  rel = eng->released;
+  mutex_unlock(&eng->lock);
+
+  // Sleep until a permit is handed to us, the timeout expires, a group
+  // wake releases us or a signal arrives
+  for (;;) {
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (READ_ONCE(w.granted) || sleepy_released(eng, rel))
+      break;
+    if (signal_pending(current)) {
+      ret = -ERESTARTSYS;
+      break;
+    }
+    if (ret == 0)
+      break;
+    ret = schedule_timeout(ret);
+  }
+  __set_current_state(TASK_RUNNING);
+
+  // A grant that raced with giving up still wins: the permit is ours and
+  // must not be lost. Otherwise leave the queue.
+  mutex_lock(&eng->lock);
+  if (w.granted) {
+    if (ret <= 0)
+      ret = 1;
+  } else {
+    sleepy_waiter_dequeue(&w);
+    if (ret >= 0 && sleepy_released(eng, rel)) {
+      grouped = 1;
+      ret = ret > 0 ? ret : 1;
+    }
+  }
+  mutex_unlock(&eng->lock);
+
+  *value = w.granted ? w.value : grouped ? sleepy_release_value(eng) : 0;
+  return ret;
+}
+
+long
+sleepy_engine_wait(struct sleepy_engine *eng, struct sleepy_wait *w,
+		   u64 *value)
+{
+  unsigned long rel;
+  struct sleepy_waiter pw;
+  wait_queue_head_t *wq;
+  unsigned long flag;
+  long timeout;
+  int barrier;
+  int grouped;
+  int queued;
+  int prio;
+  long ret;
+
+  // Whatever is left of the original timeout, if this is a resumed sleep
+  timeout = (long)(w->deadline - jiffies);
+  if (timeout < 0)
+    timeout = 0;
+
+  // Acquire mutex to access device state
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+
+  // A latched signal releases newcomers without sleeping at all
+  if (eng->signaled) {
+    *value = eng->values[eng->flag % SLEEPY_WAKE_VALUES];
+    mutex_unlock(&eng->lock);
+    return timeout > 0 ? timeout : 1;
+  }
+
+  if (eng->mode == SLEEPY_MODE_SEMAPHORE)
+    return sleepy_engine_acquire(eng, timeout, value);
+  if (eng->mode == SLEEPY_MODE_RATELIMIT)
+    return sleepy_engine_throttle(eng, timeout, value);
+
+  // A resumed sleep whose generation moved on while it was interrupted
+  // was woken in the meantime
+  if (w->has_flag && w->flag != eng->flag) {
+    mutex_unlock(&eng->lock);
+    *value = sleepy_engine_value(eng, w->flag);
+    return timeout > 0 ? timeout : 1;
+  }
+
+  // The last party to arrive releases the whole phase instead of sleeping
+  barrier = eng->mode == SLEEPY_MODE_BARRIER;
+  if (barrier && ++eng->arrived >= eng->parties) {
+    sleepy_engine_advance(eng, 1, 0);
+    *value = 0;
+    mutex_unlock(&eng->lock);
+    return timeout > 0 ? timeout : 1;
+  }
+
+  // Store the devices current flag state
+  flag = eng->flag;
+  w->flag = flag;
+  w->has_flag = 1;
+  queued = sleepy_engine_queued(eng);
+
+  // Be found by priority when the generation advances
+  prio = sleepy_prio_enter(eng, &pw, 0);
+  rel = eng->released;
+
+  // Release mutex on device state
+  mutex_unlock(&eng->lock);
+
+  // Put process to sleep for timeout jiffies or until a wake happens,
+  // on the queue of the node we are running on
+  wq = sleepy_engine_wq(eng);
+  ret = sleepy_engine_park(eng, wq, &eng->flag, flag + 1, rel, queued,
+			   timeout);
+  grouped = ret > 0 && flag == READ_ONCE(eng->flag);
+
+  if (prio)
+    sleepy_prio_leave(eng, &pw);
+
+  // A barrier party that gives up must leave the phase it arrived in, or
+  // the next phase would trip one arrival early. If the phase completed
+  // while we were giving up, count ourselves as released after all (a
+  // restarted sleep then returns at once thanks to w->flag). A group
+  // wake releases the party but leaves the phase as it was.
+  if ((ret <= 0 || grouped) && barrier) {
+    mutex_lock(&eng->lock);
+    if (flag == eng->flag) {
+      eng->arrived--;
+      w->has_flag = 0;
+    } else if (ret == 0) {
+      ret = 1;
+    }
+    mutex_unlock(&eng->lock);
+  }
+
+  if (ret <= 0)
+    *value = 0;
+  else if (grouped)
+    *value = sleepy_release_value(eng);
+  else
+    *value = sleepy_engine_value(eng, flag);
+  return ret;
+}
+
+long
+sleepy_engine_sleep(struct sleepy_engine *eng, long timeout, u64 *value)
+{
+  struct sleepy_wait w;
+
+  sleepy_wait_init(&w, timeout);
+  return sleepy_engine_wait(eng, &w, value);
+}
+
+/* ---------------------------------------------------------------- */
+/* Sub-channels */
+
+/* The sub-channel table, allocated on first use; NULL if that fails.
+ * Called with eng->lock held. */
+static struct sleepy_chans *
+sleepy_engine_chans(struct sleepy_engine *eng)
+{
+  struct sleepy_chans *tbl = eng->chans;
+  int i;
+
+  if (tbl)
+    return tbl;
+  tbl = kvmalloc(sizeof(*tbl), GFP_KERNEL);
+  if (tbl == NULL)
+    return NULL;
+  for (i = 0; i < SLEEPY_CHAN_WQS; i++)
+    init_waitqueue_head(&tbl->wq[i]);
+  memset(tbl->chan, 0, sizeof(tbl->chan));
+  // Lockless readers may find the table as soon as it is published
+  smp_wmb();
+  WRITE_ONCE(eng->chans, tbl);
+  return tbl;
+}
+
+/* Move sub-channel 'chan' on by 'n' generations carrying 'value' and
+ * wake its sleepers once */
+static int
+sleepy_engine_chan_step(struct sleepy_engine *eng, unsigned int chan,
+			unsigned long n, u64 value)
+{
+  struct sleepy_chans *tbl;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  tbl = sleepy_engine_chans(eng);
+  if (tbl == NULL) {
+    mutex_unlock(&eng->lock);
+    return -ENOMEM;
+  }
+  tbl->chan[chan].value = value;
+  tbl->chan[chan].flag += n;
+  sleepy_prio_wake(eng, chan);
+  mutex_unlock(&eng->lock);
+
+  // The table lives as long as the engine, so this is safe unlocked
+  wake_up_interruptible(&tbl->wq[chan % SLEEPY_CHAN_WQS]);
+  return 0;
+}
+
+int
+sleepy_engine_chan_post(struct sleepy_engine *eng, unsigned int chan,
+			unsigned long count, u64 value)
+{
+  if (chan == 0)
+    return sleepy_engine_post(eng, count, value);
+  if (chan >= SLEEPY_CHANNELS)
+    return -EINVAL;
+  return sleepy_engine_chan_step(eng, chan, 1, value);
+}
+
+int
+sleepy_engine_chan_advance(struct sleepy_engine *eng, unsigned int chan,
+			   unsigned long n, u64 value)
+{
+  if (chan >= SLEEPY_CHANNELS || n == 0)
+    return -EINVAL;
+  if (chan != 0)
+    return sleepy_engine_chan_step(eng, chan, n, value);
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  // Permits and tokens are not generations
+  if (eng->mode == SLEEPY_MODE_SEMAPHORE ||
+      eng->mode == SLEEPY_MODE_RATELIMIT) {
+    mutex_unlock(&eng->lock);
+    return -EINVAL;
+  }
+  sleepy_engine_advance(eng, n, value);
+  mutex_unlock(&eng->lock);
+  return 0;
+}
+
+long
+sleepy_engine_chan_wait(struct sleepy_engine *eng, unsigned int chan,
+			struct sleepy_wait *w, u64 *value)
+{
+  unsigned long rel;
+  struct sleepy_chans *tbl;
+  struct sleepy_waiter pw;
+  struct sleepy_chan *ch;
+  unsigned long flag;
+  long timeout;
+  int queued;
+  int prio;
+  long ret;
+
+  if (chan == 0)
+    return sleepy_engine_wait(eng, w, value);
+  if (chan >= SLEEPY_CHANNELS)
+    return -EINVAL;
+
+  timeout = (long)(w->deadline - jiffies);
+  if (timeout < 0)
+    timeout = 0;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  tbl = sleepy_engine_chans(eng);
+  if (tbl == NULL) {
+    mutex_unlock(&eng->lock);
+    return -ENOMEM;
+  }
+  ch = &tbl->chan[chan];
+
+  // A resumed sleep whose channel moved on while it was interrupted was
+  // woken in the meantime
+  if (w->has_flag && w->flag != ch->flag) {
+    *value = ch->value;
+    mutex_unlock(&eng->lock);
+    return timeout > 0 ? timeout : 1;
+  }
+  flag = ch->flag;
+  w->flag = flag;
+  w->has_flag = 1;
+  queued = sleepy_engine_queued(eng);
+  prio = sleepy_prio_enter(eng, &pw, chan);
+  rel = eng->released;
+  mutex_unlock(&eng->lock);
+
+  // Other channels hashed to the same queue wake us too; only our own
+  // generation (or a release) ends the sleep
+  ret = sleepy_engine_park(eng, &tbl->wq[chan % SLEEPY_CHAN_WQS], &ch->flag,
+			   flag + 1, rel, queued, timeout);
+  if (prio)
+    sleepy_prio_leave(eng, &pw);
+
+  *value = 0;
+  if (ret > 0) {
+    mutex_lock(&eng->lock);
+    *value = flag != ch->flag ? ch->value : sleepy_release_value(eng);
+    mutex_unlock(&eng->lock);
+  }
+  return ret;
+}
+
+/* ---------------------------------------------------------------- */
+/* Sequence waits */
+
+/* Generation of channel 'chan', read without the lock */
+static unsigned long
+sleepy_engine_flag(struct sleepy_engine *eng, unsigned int chan)
+{
+  struct sleepy_chans *tbl;
+
+  if (chan == 0)
+    return READ_ONCE(eng->flag);
+  tbl = READ_ONCE(eng->chans);
+  return tbl ? READ_ONCE(tbl->chan[chan].flag) : 0;
+}
+
+int
+sleepy_engine_generation(struct sleepy_engine *eng, unsigned int chan,
+			 u64 *gen)
+{
+  if (chan >= SLEEPY_CHANNELS)
+    return -EINVAL;
+  *gen = sleepy_engine_flag(eng, chan);
+  return 0;
+}
+
+/* Newest wake value of channel 'chan'. Called with eng->lock held. */
+static u64
+sleepy_engine_latest(struct sleepy_engine *eng, unsigned int chan)
+{
+  if (chan == 0)
+    return eng->values[eng->flag % SLEEPY_WAKE_VALUES];
+  return eng->chans->chan[chan].value;
+}
+
+long
+sleepy_engine_seq_wait(struct sleepy_engine *eng, unsigned int chan,
+		       long timeout, u64 expect, u64 target, u64 *value)
+{
+  unsigned long rel;
+  struct sleepy_chans *tbl;
+  struct sleepy_waiter pw;
+  wait_queue_head_t *wq;
+  unsigned long *flagp;
+  int queued;
+  int prio;
+  long ret;
+
+  if (chan >= SLEEPY_CHANNELS)
+    return -EINVAL;
+  if (target == 0)
+    target = expect + 1;
+  if (timeout < 0)
+    timeout = 0;
+
+  if (mutex_lock_killable(&eng->lock))
+    return -EINTR;
+  if (chan == 0) {
+    if (eng->mode == SLEEPY_MODE_SEMAPHORE ||
+	eng->mode == SLEEPY_MODE_RATELIMIT) {
+      mutex_unlock(&eng->lock);
+      return -EINVAL;
+    }
+    flagp = &eng->flag;
+    wq = sleepy_engine_wq(eng);
+  } else {
+    tbl = sleepy_engine_chans(eng);
+    if (tbl == NULL) {
+      mutex_unlock(&eng->lock);
+      return -ENOMEM;
+    }
+    flagp = &tbl->chan[chan].flag;
+    wq = &tbl->wq[chan % SLEEPY_CHAN_WQS];
+  }
+
+  // The caller is behind: whatever it was waiting for may have happened
+  if (*flagp != (unsigned long)expect) {
+    *value = sleepy_engine_latest(eng, chan);
+    mutex_unlock(&eng->lock);
+    return timeout > 0 ? timeout : 1;
+  }
+  queued = sleepy_engine_queued(eng);
+  prio = sleepy_prio_enter(eng, &pw, chan);
+  rel = eng->released;
+  mutex_unlock(&eng->lock);
+
+  // Neither a barrier party nor a latch consumer: only the count matters
+  ret = sleepy_engine_park(eng, wq, flagp, target, rel, queued, timeout);
+  if (prio)
+    sleepy_prio_leave(eng, &pw);
+
+  *value = 0;
+  if (ret > 0) {
+    mutex_lock(&eng->lock);
+    if (sleepy_seq_reached(*flagp, target))
+      *value = sleepy_engine_latest(eng, chan);
+    else
+      *value = sleepy_release_value(eng);
+    mutex_unlock(&eng->lock);
+  }
+  return ret;
+}
+
+/* ---------------------------------------------------------------- */
+/* Non-blocking sleeps. Most of them fail, so the common answer comes
+ * from a few unlocked reads; only a sleep that may well succeed takes
+ * the lock, and then sleeps for zero jiffies. */
+
+long
+sleepy_engine_try(struct sleepy_engine *eng, unsigned int chan, u64 *value)
+{
+  struct sleepy_wait w;
+  long ret;
+
+  *value = 0;
+  if (chan >= SLEEPY_CHANNELS)
+    return -EINVAL;
+
+  // Sub-channels and EDGE sleeps wait for a wake that cannot have
+  // happened yet
+  if (chan != 0)
+    return 0;
+  switch (READ_ONCE(eng->mode)) {
+  case SLEEPY_MODE_EDGE:
+    return 0;
+  case SLEEPY_MODE_LATCHED:
+    if (!READ_ONCE(eng->signaled))
+      return 0;
+    smp_rmb();
+    *value = READ_ONCE(eng->values[READ_ONCE(eng->flag) %
+				   SLEEPY_WAKE_VALUES]);
+    return 1;
+  case SLEEPY_MODE_BARRIER:
+    if (READ_ONCE(eng->arrived) + 1 < READ_ONCE(eng->parties))
+      return 0;
+    break;
+  case SLEEPY_MODE_SEMAPHORE:
+    if (READ_ONCE(eng->permits) == 0)
+      return 0;
+    break;
+  }
+
+  sleepy_wait_init(&w, 0);
+  ret = sleepy_engine_wait(eng, &w, value);
+  return ret > 0 ? 1 : ret;
+}
+
+long
+sleepy_engine_seq_try(struct sleepy_engine *eng, unsigned int chan,
+		      u64 expect, u64 target, u64 *value)
+{
+  struct sleepy_chans *tbl;
+  unsigned long flag;
+  int mode;
+
+  *value = 0;
+  if (chan >= SLEEPY_CHANNELS)
+    return -EINVAL;
+  mode = READ_ONCE(eng->mode);
+  if (chan == 0 &&
+      (mode == SLEEPY_MODE_SEMAPHORE || mode == SLEEPY_MODE_RATELIMIT))
+    return -EINVAL;
+  if (target == 0)
+    target = expect + 1;
+
+  flag = sleepy_engine_flag(eng, chan);
+  if (flag == (unsigned long)expect && !sleepy_seq_reached(flag, target))
+    return 0;
+
+  // Best effort: a wake racing with us may already have replaced it
+  smp_rmb();
+  if (chan == 0) {
+    *value = READ_ONCE(eng->values[flag % SLEEPY_WAKE_VALUES]);
+  } else {
+    tbl = READ_ONCE(eng->chans);
+    *value = tbl ? READ_ONCE(tbl->chan[chan].value) : 0;
+  }
+  return 1;
+}
@@ -0,0 +1,384 @@
+/* sleepy_core.h - the wait/wake engine behind each sleepy device.
+ *
+ * The engine knows nothing about files, minors or user memory; that is
+ * sleepy_dev.c's job. Keeping it free of those lets the same source build
+ * inside the module and as a userspace library (see sleepy_user.h).
+ */
+
+#ifndef SLEEPY_CORE_H_1727_INCLUDED
+#define SLEEPY_CORE_H_1727_INCLUDED
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#else
+#include "sleepy_user.h"
+#endif
+
+#include "sleepy_ioctl.h"
+
+/* Number of recent wake values kept so that a sleeper which runs late
+ * still gets the value of the wake that ended its sleep (power of 2) */
+#define SLEEPY_WAKE_VALUES 8
+
+/* A sleeper queued on the engine for a direct handoff, or on its
+ * deadline queue.
+ *  link - position in sleepy_engine.waiters;
+ *  task - the sleeping task;
+ *  granted - set under the engine lock once the handoff happened;
+ *  value - wake value handed over with the grant;
+ *  expires - deadline queue: ktime_get_ns() at which the sleep times out;
+ *  heap_idx - deadline queue: position in tq_heap, or SLEEPY_TQ_NONE;
+ *  expired - deadline queue: set once the queue timed the sleeper out;
+ *  cpu, node - where the sleeper parked;
+ *  prio - its scheduling priority when it parked (lower is more urgent);
+ *  chan - PRIO sleepers: the channel slept on;
+ *  nlink - position in its node's waiters (CONFIG_NUMA).
+ */
+struct sleepy_waiter {
+  struct list_head link;
+  struct task_struct *task;
+  int granted;
+  u64 value;
+  u64 expires;
+  unsigned int heap_idx;
+  int expired;
+  int cpu;
+  int node;
+  int prio;
+  unsigned int chan;
+  struct list_head nlink;
+};
+
+#ifdef CONFIG_NUMA
+/* Per-NUMA-node part of an engine. Sleepers park on the queue of the node
+ * they run on, so that a wake can be issued from that node.
+ *  wq - EDGE, LATCHED and BARRIER sleepers of this node;
+ *  waiters - SEMAPHORE and RATELIMIT sleepers of this node, oldest first;
+ *  wake - helper that wakes wq from a CPU of this node.
+ */
+struct sleepy_node {
+  wait_queue_head_t wq;
+  struct list_head waiters;
+  struct work_struct wake;
+};
+#endif
+
+#define SLEEPY_TQ_NONE ((unsigned int)-1)
+
+/* One sleep, kept apart from the call so that an interrupted sleep can be
+ * resumed with exactly what it had left.
+ *  deadline - when the sleep times out, in jiffies;
+ *  flag - generation the sleeper is waiting to see change;
+ *  has_flag - flag is valid and must be kept when resuming, so that a
+ *    wake that happened while interrupted is not lost.
+ */
+struct sleepy_wait {
+  unsigned long deadline;
+  unsigned long flag;
+  int has_flag;
+};
+
+static inline void
+sleepy_wait_init(struct sleepy_wait *w, long timeout)
+{
+  w->deadline = jiffies + timeout;
+  w->flag = 0;
+  w->has_flag = 0;
+}
+
+/* Something outside the engine that wants to hear about every new
+ * generation, e.g. an asynchronous wait from the ring interface.
+ *  link - position in sleepy_engine.watches;
+ *  notify - called with eng->lock held after each generation advance
+ *    with the new flag and its value; must not sleep, and returns
+ *    nonzero to be unregistered;
+ *  flag - generation at the previous notify (or at registration), so
+ *    that notify can tell how far an advance went (set by the engine).
+ */
+struct sleepy_watch {
+  struct list_head link;
+  int (*notify)(struct sleepy_watch *w, unsigned long flag, u64 value);
+  unsigned long flag;
+};
+
+/* Groups of engines that are woken together: a group wake releases
+ * every member engine as sleepy_engine_release() does, so sleepers only
+ * ever check their own engine. Every engine is a member of group 0, and
+ * of at most one other group.
+ *  lock - protects members; taken before any member's eng->lock;
+ *  members - engines of group 0 by g0link, of the others by glink.
+ */
+struct sleepy_groups {
+  struct mutex lock;
+  struct list_head members[SLEEPY_GROUPS];
+};
+
+/* Sub-channels 1 to SLEEPY_CHANNELS - 1 of an engine (channel 0 is the
+ * engine itself). Each is just a generation and the value of its latest
+ * wake; their sleepers share SLEEPY_CHAN_WQS wait queues, hashed by
+ * channel, and check their own generation when woken.
+ *  wq - the shared wait queues;
+ *  chan - generation and latest wake value of each channel (under
+ *    eng->lock).
+ */
+#define SLEEPY_CHAN_WQS 64
+
+struct sleepy_chan {
+  unsigned long flag;
+  u64 value;
+};
+
+struct sleepy_chans {
+  wait_queue_head_t wq[SLEEPY_CHAN_WQS];
+  struct sleepy_chan chan[SLEEPY_CHANNELS];
+};
+
+/* State shared by everyone sleeping on or waking one device.
+ *  lock - protects the fields of this structure;
+ *  wq - sleepers park here until flag changes or they time out (on NUMA
+ *    machines, on their node's queue in nodes instead);
+ *  flag - wake generation, advanced by every sleepy_engine_wake();
+ *  values - value attached to generation g lives in
+ *    values[g % SLEEPY_WAKE_VALUES];
+ *  mode - SLEEPY_MODE_* of the device;
+ *  signaled - LATCHED mode only: a wake is pending until reset;
+ *  parties - BARRIER mode: sleepers needed to complete a phase;
+ *  arrived - BARRIER mode: sleepers parked in the current phase;
+ *  permits - SEMAPHORE mode: permits nobody has taken yet;
+ *  waiters - SEMAPHORE and RATELIMIT modes: sleepy_waiters in arrival
+ *    (FIFO) order;
+ *  policy - SLEEPY_POLICY_*: which of the waiters a permit goes to
+ *    (under PRIO, waiters is kept in priority order);
+ *  sleepers - PRIO policy: EDGE, LATCHED and BARRIER sleepers, and those
+ *    of sub-channels and sequence waits, in priority order, so a
+ *    broadcast can wake the most urgent ones first;
+ *  rate, burst - RATELIMIT mode: tokens per second and bucket size;
+ *  tokens - RATELIMIT mode: bucket level in 1/NSEC_PER_SEC tokens;
+ *  stamp - RATELIMIT mode: ktime_get_ns() of the last refill;
+ *  timers - SLEEPY_TIMERS_*: how EDGE, LATCHED and BARRIER sleeps time out;
+ *  tq_lock - protects the deadline queue below (taken from the hrtimer);
+ *  tq_heap, tq_len, tq_cap - min-heap of queued sleepers by expiry;
+ *  tq_timer - the one hrtimer, armed for the earliest expiry;
+ *  timer_cpu - CPU that tq_timer is pinned to, or -1 for wherever it is
+ *    armed; setting one puts every timeout on the deadline queue;
+ *  tq_arm - work arming tq_timer from timer_cpu (kernel only);
+ *  tq_expiries, tq_hk_expiries - tq_timer expiries, and how many of them
+ *    ran on timer_cpu (under tq_lock);
+ *  tq_remote_arms - arms handed to timer_cpu (under tq_lock);
+ *  watches - registered sleepy_watches;
+ *  chans - sub-channel table, allocated when a channel other than 0 is
+ *    first used;
+ *  groups - groups the engine can be woken through, or NULL;
+ *  group - its group besides group 0 (0 for none; under groups->lock);
+ *  g0link, glink - positions in group 0's and in its own group's members
+ *    (glink is empty for none);
+ *  released, release_value - count and value of sleepy_engine_release()
+ *    calls;
+ *  nodes - per-node queues, one per possible node (CONFIG_NUMA; NULL if
+ *    they could not be allocated).
+ */
+struct sleepy_engine {
+  struct mutex lock;
+  wait_queue_head_t wq;
+  unsigned long flag;
+  u64 values[SLEEPY_WAKE_VALUES];
+  int mode;
+  int signaled;
+  unsigned int parties;
+  unsigned int arrived;
+  unsigned long permits;
+  struct list_head waiters;
+  int policy;
+  struct list_head sleepers;
+  u32 rate;
+  u32 burst;
+  u64 tokens;
+  u64 stamp;
+  int timers;
+  spinlock_t tq_lock;
+  struct sleepy_waiter **tq_heap;
+  unsigned int tq_len;
+  unsigned int tq_cap;
+  struct hrtimer tq_timer;
+  int timer_cpu;
+#ifdef __KERNEL__
+  struct work_struct tq_arm;
+#endif
+  unsigned long tq_expiries;
+  unsigned long tq_hk_expiries;
+  unsigned long tq_remote_arms;
+  struct list_head watches;
+  struct sleepy_chans *chans;
+  struct sleepy_groups *groups;
+  unsigned int group;
+  struct list_head g0link;
+  struct list_head glink;
+  unsigned long released;
+  u64 release_value;
+#ifdef CONFIG_NUMA
+  struct sleepy_node *nodes;
+#endif
+};
+
+void sleepy_engine_init(struct sleepy_engine *eng);
+
+/* Release what the engine allocated and leave its groups. Nobody may be
+ * sleeping on it. */
+void sleepy_engine_destroy(struct sleepy_engine *eng);
+
+/* Advance the generation and wake every current sleeper, each of which
+ * receives 'value'. In SEMAPHORE mode, add a single permit instead.
+ * Returns 0 or -EINTR if interrupted while taking the lock. */
+int sleepy_engine_wake(struct sleepy_engine *eng, u64 value);
+
+/* Like sleepy_engine_wake(), except that in SEMAPHORE mode it adds
+ * 'count' permits instead of one and in RATELIMIT mode 'count' tokens.
+ * In the other modes it is a plain wake, which advances the generation
+ * by 1 whatever 'count' is (see sleepy_engine_chan_advance()). */
+int sleepy_engine_post(struct sleepy_engine *eng, unsigned long count,
+		       u64 value);
+
+void sleepy_groups_init(struct sleepy_groups *g);
+
+/* Release every current sleeper of the engines in 'group' with 'value'.
+ * Walks the members, taking each eng->lock in turn under g->lock, so it
+ * is O(members). 'woken', if not NULL, is called for each member once it
+ * is released, with g->lock still held. Returns 0, -EINVAL for a group
+ * out of range or -EINTR. */
+int sleepy_groups_wake(struct sleepy_groups *g, unsigned int group,
+		       u64 value,
+		       void (*woken)(struct sleepy_engine *eng, u64 value));
+
+/* Make the engine a member of group 0 of 'groups'. Call before anyone
+ * sleeps on it. */
+void sleepy_engine_set_groups(struct sleepy_engine *eng,
+			      struct sleepy_groups *groups);
+
+/* Move the engine to 'group' (0 for none but group 0). Returns 0,
+ * -EINVAL or -EINTR. */
+int sleepy_engine_set_group(struct sleepy_engine *eng, unsigned int group);
+
+/* Release every current sleeper of the engine with 'value', in any mode
+ * and on any channel, the way a group wake does, without moving any
+ * generation. Only the engine's own queues are woken. Returns 0 or
+ * -EINTR. */
+int sleepy_engine_release(struct sleepy_engine *eng, u64 value);
+
+/* Register 'w' to be notified of every generation advance from now on.
+ * Returns 0 or -EINTR if interrupted while taking the lock. */
+int sleepy_engine_watch(struct sleepy_engine *eng, struct sleepy_watch *w);
+
+/* Unregister 'w' if it still is. Once this returns, its notify callback
+ * is not running and will not be called again. */
+void sleepy_engine_unwatch(struct sleepy_engine *eng, struct sleepy_watch *w);
+
+/* Switch to one of the SLEEPY_MODE_* modes. Returns 0, -EINVAL for an
+ * unknown mode or -EINTR if interrupted while taking the lock. */
+int sleepy_engine_set_mode(struct sleepy_engine *eng, int mode);
+
+/* Set the BARRIER party count (at least 1). Returns 0, -EINVAL or
+ * -EINTR. Shrinking it below the parties already parked releases them. */
+int sleepy_engine_set_parties(struct sleepy_engine *eng,
+			      unsigned int parties);
+
+/* Configure the RATELIMIT token bucket and fill it. Returns 0, -EINVAL
+ * for a zero rate or -EINTR. */
+int sleepy_engine_set_rate(struct sleepy_engine *eng, u32 rate, u32 burst);
+
+/* Choose how timeouts are served (SLEEPY_TIMERS_*). Sleepers already
+ * parked keep the scheme they started with. Returns 0 or -EINVAL. */
+int sleepy_engine_set_timers(struct sleepy_engine *eng, int timers);
+
+/* Pin deadline-queue timeouts to 'cpu' (-1 to stop), e.g. a housekeeping
+ * CPU, so that timeouts armed on isolated CPUs do not interrupt them.
+ * EDGE, LATCHED and BARRIER sleepers, and those of sub-channels and
+ * sequence waits, then always use the deadline queue. Returns 0, -EINVAL
+ * for a CPU that is not online, or -EINTR. */
+int sleepy_engine_set_timer_cpu(struct sleepy_engine *eng, int cpu);
+
+/* Snapshot the deadline-queue timer counters. */
+void sleepy_engine_timer_stats(struct sleepy_engine *eng,
+			       struct sleepy_timer_stats *st);
+
+/* Choose which waiter SEMAPHORE permits go to (SLEEPY_POLICY_*).
+ * Returns 0, -EINVAL or -EINTR. */
+int sleepy_engine_set_policy(struct sleepy_engine *eng, int policy);
+
+/* Clear the signal of a LATCHED engine (no-op in other modes). */
+int sleepy_engine_reset(struct sleepy_engine *eng);
+
+/* Sleep for up to 'timeout' jiffies or until the next wake.
+ * Returns the jiffies left when woken, 0 on timeout, or a negative
+ * errno if interrupted. When woken, *value is the value passed to the
+ * wake that ended the sleep (or the newest one, if SLEEPY_WAKE_VALUES
+ * more wakes have happened since); otherwise it is 0. A signaled
+ * LATCHED engine, the arrival that completes a BARRIER phase, or a
+ * SEMAPHORE or RATELIMIT sleeper that finds a free permit or token
+ * returns 'timeout' (at least 1) immediately. */
+long sleepy_engine_sleep(struct sleepy_engine *eng, long timeout,
+			 u64 *value);
+
+/* sleepy_engine_sleep() for a prepared sleepy_wait. When it returns
+ * -ERESTARTSYS, calling it again with the same 'w' resumes the sleep:
+ * same deadline and, where the mode allows, same generation. */
+long sleepy_engine_wait(struct sleepy_engine *eng, struct sleepy_wait *w,
+			u64 *value);
+
+/* sleepy_engine_post() on channel 'chan': channel 0 is the engine itself,
+ * any other one just advances that channel's generation by 1 and wakes
+ * its sleepers with 'value'. Returns 0, -EINVAL for a channel out of
+ * range, -ENOMEM or -EINTR. */
+int sleepy_engine_chan_post(struct sleepy_engine *eng, unsigned int chan,
+			    unsigned long count, u64 value);
+
+/* Advance the generation of channel 'chan' by 'n' with a single wake
+ * carrying 'value', e.g. for a producer that published n items. Returns
+ * 0, -EINVAL for a channel out of range, n == 0, or channel 0 of a
+ * SEMAPHORE or RATELIMIT engine, -ENOMEM or -EINTR. */
+int sleepy_engine_chan_advance(struct sleepy_engine *eng, unsigned int chan,
+			       unsigned long n, u64 value);
+
+/* sleepy_engine_wait() on channel 'chan'; sleeps on channels other than 0
+ * behave as in EDGE mode, with the engine's timeout scheme and policy.
+ * Same returns, plus -EINVAL or -ENOMEM. */
+long sleepy_engine_chan_wait(struct sleepy_engine *eng, unsigned int chan,
+			     struct sleepy_wait *w, u64 *value);
+
+/* Store the generation of channel 'chan' in *gen, without locking.
+ * Returns 0 or -EINVAL. */
+int sleepy_engine_generation(struct sleepy_engine *eng, unsigned int chan,
+			     u64 *gen);
+
+/* Sleep on channel 'chan' for up to 'timeout' jiffies until its
+ * generation reaches 'target' (0 for expect + 1), provided it is still
+ * 'expect' on entry. Returns like sleepy_engine_sleep(), and at once as
+ * if woken if the generation was not 'expect'; -EINVAL on channel 0 of a
+ * SEMAPHORE or RATELIMIT engine, or -ENOMEM. *value is the latest wake
+ * value. The engine keeps nothing for an interrupted sequence wait; a
+ * caller that restarts it passes what is left of the timeout. Timeouts and
+ * PRIO order follow the engine's settings as for any other sleep. */
+long sleepy_engine_seq_wait(struct sleepy_engine *eng, unsigned int chan,
+			    long timeout, u64 expect, u64 target, u64 *value);
+
+/* Would a sleep on channel 'chan' return at once? If so, takes what it
+ * would have (a permit, a barrier arrival) and returns 1 with the wake
+ * value in *value; otherwise returns 0 (or a negative errno) without
+ * sleeping. Cases that cannot succeed are settled without any lock. */
+long sleepy_engine_try(struct sleepy_engine *eng, unsigned int chan,
+		       u64 *value);
+
+/* Non-blocking sleepy_engine_seq_wait(), without any lock: 1 (with the
+ * latest wake value) if the wait would return at once, 0 if it would
+ * sleep, or -EINVAL. */
+long sleepy_engine_seq_try(struct sleepy_engine *eng, unsigned int chan,
+			   u64 expect, u64 target, u64 *value);
+
+#endif /* SLEEPY_CORE_H_1727_INCLUDED */
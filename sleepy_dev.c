@@ -0,0 +1,1410 @@
+/* cfake.c - implementation of a simple module for a character device 
+ * can be used for testing, demonstrations, etc.
+ */
+
+/* ========================================================================
+ * Copyright (C) 2010-2011, Institute for System Programming 
+ *                          of the Russian Academy of Sciences (ISPRAS)
+ * Authors: 
+ *      Eugene A. Shatokhin <spectre@ispras.ru>
+ *      Andrey V. Tsyvarev  <tsyvarev@ispras.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ ======================================================================== */
+
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/signal.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/eventfd.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include <asm/uaccess.h>
+
+#include "sleepy_ioctl.h"
+#include "sleepy_core.h"
+#include "sleepy_tq.h"
+#include "sleepy_nl.h"
+#include "sleepy.h"
+
+MODULE_AUTHOR("Eugene A. Shatokhin, John Regehr");
+MODULE_LICENSE("GPL");
+
+#define SLEEPY_DEVICE_NAME "sleepy"
+
+/* How long past its deadline an interrupted sleep may still be resumed */
+#define SLEEPY_RESTART_GRACE HZ
+
+/* Most eventfds one device signals */
+#define SLEEPY_EVENTFDS_MAX 64
+
+/* Most scheduled wakes pending on one device */
+#define SLEEPY_ALARMS_MAX 1024
+
+/* parameters */
+static int sleepy_ndevices = SLEEPY_NDEVICES;
+
+/* Serve timeouts from one deadline queue per device (SLEEPY_TIMERS_QUEUE)
+ * rather than a timer per sleeper; can be changed per device by ioctl */
+static int sleepy_timer_queue = 0;
+
+/* Pin every device's timeout timer to this CPU (e.g. a housekeeping CPU
+ * on nohz_full systems); -1 leaves timers where they are armed */
+static int sleepy_timer_cpu = -1;
+
+module_param(sleepy_ndevices, int, S_IRUGO);
+module_param(sleepy_timer_queue, int, S_IRUGO);
+module_param(sleepy_timer_cpu, int, S_IRUGO);
+/* ================================================================ */
+
+static unsigned int sleepy_major = 0;
+static struct sleepy_dev *sleepy_devices = NULL;
+static struct class *sleepy_class = NULL;
+
+/* Groups every device belongs to (see SLEEPY_IOC_GROUP_WAKE) */
+static struct sleepy_groups sleepy_groups;
+
+/* Protects the trigger graph: every device's triggers list */
+static DEFINE_MUTEX(sleepy_trigger_mutex);
+
+/* Runs the wakes of fired alarms; flushed before a device goes away */
+static struct workqueue_struct *sleepy_alarm_wq = NULL;
+
+/* debugfs directory with one file per device listing its sleepers */
+static struct dentry *sleepy_debugfs = NULL;
+/* ================================================================ */
+
+static void sleepy_eventfd_drop(struct sleepy_dev *dev,
+				struct sleepy_eventfd *ev);
+
+int 
+sleepy_open(struct inode *inode, struct file *filp)
+{
+  unsigned int mj = imajor(inode);
+  unsigned int mn = iminor(inode);
+	
+  struct sleepy_dev *dev = NULL;
+	
+  if (mj != sleepy_major || mn < 0 || mn >= sleepy_ndevices)
+    {
+      printk(KERN_WARNING "[target] "
+	     "No device found with minor=%d and major=%d\n", 
+	     mj, mn);
+      return -ENODEV; /* No such device */
+    }
+	
+  /* store a pointer to struct sleepy_dev here for other methods */
+  dev = &sleepy_devices[mn];
+  filp->private_data = dev; 
+
+  if (inode->i_cdev != &dev->cdev)
+    {
+      printk(KERN_WARNING "[target] open: internal error\n");
+      return -ENODEV; /* No such device */
+    }
+	
+  return 0;
+}
+
+int 
+sleepy_release(struct inode *inode, struct file *filp)
+{
+  struct sleepy_dev *dev = (struct sleepy_dev *)filp->private_data;
+  struct sleepy_eventfd *ev, *evtmp;
+  struct sleepy_restart *rs, *tmp;
+
+  // Interrupted sleeps on this file can no longer be restarted
+  spin_lock(&dev->restart_lock);
+  list_for_each_entry_safe(rs, tmp, &dev->restarts, link) {
+    if (rs->filp == filp) {
+      list_del(&rs->link);
+      kfree(rs);
+    }
+  }
+  spin_unlock(&dev->restart_lock);
+
+  // Its eventfd registrations go with it
+  mutex_lock(&dev->sleepy_mutex);
+  list_for_each_entry_safe(ev, evtmp, &dev->eventfds, link)
+    if (ev->filp == filp)
+      sleepy_eventfd_drop(dev, ev);
+  mutex_unlock(&dev->sleepy_mutex);
+  return 0;
+}
+
+/* Find and unlink the sleep this task had interrupted on 'filp' with the
+ * same channel, timeout and kind ('seq' for a sequence wait), if any.
+ * Records are only saved for calls the kernel restarts by itself; one
+ * too far past its deadline is left over from a restart that never came
+ * (a handler without SA_RESTART slipped in) and is dropped. */
+static struct sleepy_restart *
+sleepy_take_restart(struct sleepy_dev *dev, struct file *filp,
+		    unsigned int chan, int sleep_seconds, int seq)
+{
+  struct sleepy_restart *rs, *found = NULL;
+
+  spin_lock(&dev->restart_lock);
+  list_for_each_entry(rs, &dev->restarts, link) {
+    if (rs->filp == filp && rs->pid == current->pid) {
+      list_del(&rs->link);
+      found = rs;
+      break;
+    }
+  }
+  spin_unlock(&dev->restart_lock);
+
+  if (found && (found->chan != chan || found->seconds != sleep_seconds ||
+		found->seq != seq ||
+		time_after(jiffies, found->wait.deadline + SLEEPY_RESTART_GRACE))) {
+    kfree(found);
+    found = NULL;
+  }
+  return found;
+}
+
+/* Will the kernel restart a call interrupted now, rather than return
+ * EINTR? Only if every signal about to be delivered has no handler or an
+ * SA_RESTART one, which is what signal delivery looks at. */
+static int
+sleepy_signal_restarts(void)
+{
+  struct sighand_struct *sighand = current->sighand;
+  struct k_sigaction *ka;
+  sigset_t pending;
+  int sig, restarts = 1;
+
+  spin_lock_irq(&sighand->siglock);
+  sigorsets(&pending, &current->pending.signal,
+	    &current->signal->shared_pending.signal);
+  sigandnsets(&pending, &pending, &current->blocked);
+  for (sig = 1; sig <= _NSIG; sig++) {
+    if (!sigismember(&pending, sig))
+      continue;
+    ka = &sighand->action[sig - 1];
+    if (ka->sa.sa_handler != SIG_DFL && ka->sa.sa_handler != SIG_IGN &&
+	!(ka->sa.sa_flags & SA_RESTART))
+      restarts = 0;
+  }
+  spin_unlock_irq(&sighand->siglock);
+  return restarts;
+}
+
+/* Remember an interrupted sleep so that the restarted call resumes it.
+ * Without memory the call simply starts over. */
+static void
+sleepy_save_restart(struct sleepy_dev *dev, struct file *filp,
+		    unsigned int chan, int sleep_seconds, int seq,
+		    struct sleepy_wait *wait)
+{
+  struct sleepy_restart *rs;
+
+  rs = kmalloc(sizeof(*rs), GFP_KERNEL);
+  if (rs == NULL)
+    return;
+  rs->filp = filp;
+  rs->pid = current->pid;
+  rs->chan = chan;
+  rs->seconds = sleep_seconds;
+  rs->seq = seq;
+  rs->wait = *wait;
+
+  spin_lock(&dev->restart_lock);
+  list_add(&rs->link, &dev->restarts);
+  spin_unlock(&dev->restart_lock);
+}
+
+/* Channel selected by file position 'pos', or -EINVAL */
+static int
+sleepy_chan(loff_t pos)
+{
+  if (pos < 0 || pos >= SLEEPY_CHANNELS)
+    return -EINVAL;
+  return (int)pos;
+}
+
+/* Wake everyone sleeping on channel 'chan' of the device, attaching
+ * 'value' for them. A semaphore device gets 'count' permits instead. */
+static int
+sleepy_do_wake(struct file *filp, loff_t chan, unsigned long count,
+	       u64 value)
+{
+  struct sleepy_dev *dev = (struct sleepy_dev *)filp->private_data;
+  int ret;
+
+  ret = sleepy_chan(chan);
+  if (ret < 0)
+    return ret;
+
+  // Advance the channel generation and wake up everyone sleeping on it
+  ret = sleepy_engine_chan_post(&dev->engine, ret, count, value);
+  if (ret)
+    return ret;
+  sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, chan,
+		  min_t(unsigned long, count, INT_MAX), value);
+
+  // Print testing information
+  int minor;
+  minor = (int)iminor(filp->f_path.dentry->d_inode);
+  printk("SLEEPY_READ DEVICE (%d): Process is waking everyone up. \n", minor);
+
+  return 0;
+}
+
+/* SLEEPY_IOC_ADVANCE on channel 'chan' */
+static int
+sleepy_do_advance(struct file *filp, loff_t chan, struct sleepy_advance *adv)
+{
+  struct sleepy_dev *dev = (struct sleepy_dev *)filp->private_data;
+  int ret;
+
+  ret = sleepy_chan(chan);
+  if (ret < 0)
+    return ret;
+  if (adv->count == 0 || adv->count > ULONG_MAX)
+    return -EINVAL;
+
+  ret = sleepy_engine_chan_advance(&dev->engine, ret, adv->count,
+				   adv->value);
+  if (ret)
+    return ret;
+  sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, chan,
+		  min_t(u64, adv->count, INT_MAX), adv->value);
+  return 0;
+}
+
+/* Count the caller in to a blocking sleep on 'chan' until 'deadline',
+ * ended by generation 'gen', for SLEEPY_IOC_DRAIN and debugfs. Returns
+ * its listing, NULL if there was no memory for one. */
+static struct sleepy_sleeper *
+sleepy_sleeper_enter(struct sleepy_dev *dev, unsigned int chan,
+		     unsigned long deadline, u64 gen)
+{
+  struct sleepy_sleeper *s;
+
+  atomic_inc(&dev->sleepers);
+  s = kmalloc(sizeof(*s), GFP_KERNEL);
+  if (s == NULL)
+    return NULL;
+  s->task = current;
+  s->chan = chan;
+  s->start = ktime_get_ns();
+  s->deadline = deadline;
+  s->gen = gen;
+
+  // sleeper_lock only orders sleepers among themselves; readers never
+  // take it
+  spin_lock(&dev->sleeper_lock);
+  list_add_tail_rcu(&s->link, &dev->sleeper_list);
+  spin_unlock(&dev->sleeper_lock);
+  return s;
+}
+
+static void
+sleepy_sleeper_leave(struct sleepy_dev *dev, struct sleepy_sleeper *s)
+{
+  if (s) {
+    spin_lock(&dev->sleeper_lock);
+    list_del_rcu(&s->link);
+    spin_unlock(&dev->sleeper_lock);
+    kfree_rcu(s, rcu);
+  }
+  if (atomic_dec_and_test(&dev->sleepers))
+    wake_up_all(&dev->drain_wq);
+}
+
+/* Report how a blocking sleep ended, from the jiffies it had left */
+static void
+sleepy_sleep_event(struct sleepy_dev *dev, unsigned int chan, long ret,
+		   u64 *value)
+{
+  if (ret > 0)
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_WOKEN, chan, ret / HZ, *value);
+  else if (ret == 0)
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_TIMEOUT, chan, 0, 0);
+  else
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_INTERRUPT, chan, ret, 0);
+}
+
+/* Sleep on channel 'chan' of the device for 'sleep_seconds' or until
+ * woken. Returns the remaining seconds (0 on timeout) and stores the wake
+ * value in *value. */
+static long
+sleepy_do_sleep(struct file *filp, loff_t chan, int sleep_seconds,
+		u64 *value)
+{
+  struct sleepy_dev *dev = (struct sleepy_dev *)filp->private_data;
+  struct sleepy_restart *rs;
+  struct sleepy_sleeper *s;
+  struct sleepy_wait wait;
+  long retval;
+  u64 gen;
+
+  retval = sleepy_chan(chan);
+  if (retval < 0)
+    return retval;
+
+  // A negative timeout would reach schedule_timeout() as a huge or
+  // negative jiffies value, and seconds * HZ must not overflow an int
+  if (sleep_seconds < 0)
+    return -EINVAL;
+  long sleep_jiffies = (long)sleep_seconds * HZ;
+
+  // Sleeps that must not block are answered on the spot, mostly without
+  // taking a lock
+  if ((filp->f_flags & O_NONBLOCK) || sleep_seconds == 0) {
+    retval = sleepy_engine_try(&dev->engine, chan, value);
+    if (retval == 0)
+      return sleep_seconds ? -EAGAIN : 0;
+    return retval < 0 ? retval : sleep_seconds;
+  }
+
+  // Resume the sleep a signal interrupted, or start a new one
+  rs = sleepy_take_restart(dev, filp, chan, sleep_seconds, 0);
+  if (rs) {
+    wait = rs->wait;
+    kfree(rs);
+  } else {
+    sleepy_wait_init(&wait, sleep_jiffies);
+  }
+
+  // A resumed sleep still waits for the generation it first saw to move
+  if (wait.has_flag)
+    gen = wait.flag;
+  else
+    sleepy_engine_generation(&dev->engine, chan, &gen);
+
+  // Put process to sleep for sleep_jiffies or until a read happens
+  s = sleepy_sleeper_enter(dev, chan, wait.deadline, gen + 1);
+  sleepy_nl_event(&dev->events, SLEEPY_EVENT_SLEEP, chan, sleep_seconds, 0);
+  retval = sleepy_engine_chan_wait(&dev->engine, chan, &wait, value);
+  sleepy_sleeper_leave(dev, s);
+  sleepy_sleep_event(dev, chan, retval, value);
+
+  // Signals without a handler or with an SA_RESTART one restart the call
+  // transparently, with whatever time and generation the sleep had left.
+  // Anything else gets EINTR and a fresh sleep next time.
+  if (retval == -ERESTARTSYS) {
+    if (sleepy_signal_restarts())
+      sleepy_save_restart(dev, filp, chan, sleep_seconds, 0, &wait);
+    else
+      retval = -EINTR;
+  }
+
+  // Calculate remaining sleep seconds if sleep was interrupted
+  if (retval > 0)
+    retval = retval/HZ;
+  
+  // Print testing information
+  int minor;
+  minor = (int)iminor(filp->f_path.dentry->d_inode);
+  printk("SLEEPY_WRITE DEVICE (%d): remaining = %ld \n", minor, retval);
+
+  return retval;
+}
+
+ssize_t 
+sleepy_read(struct file *filp, char __user *buf, size_t count, 
+	    loff_t *f_pos)
+{
+  // A zero-length read still counts as one permit; outside SEMAPHORE and
+  // RATELIMIT modes any read is one wake. The position picks the channel
+  // and is left where it is.
+  return sleepy_do_wake(filp, *f_pos, count ? count : 1, 0);
+}
+                
+/* Sleep on channel 'chan' as 'seq' says (see struct sleepy_seq_wait).
+ * Returns the remaining seconds, 0 on timeout. */
+static long
+sleepy_do_seq_wait(struct file *filp, loff_t chan,
+		   struct sleepy_seq_wait *seq, u64 *value)
+{
+  struct sleepy_dev *dev = (struct sleepy_dev *)filp->private_data;
+  struct sleepy_restart *rs;
+  struct sleepy_sleeper *s;
+  struct sleepy_wait wait;
+  long retval;
+
+  retval = sleepy_chan(chan);
+  if (retval < 0)
+    return retval;
+  if (seq->seconds < 0 || seq->flags != 0)
+    return -EINVAL;
+
+  // Without blocking, this just reports whether the generation moved
+  if ((filp->f_flags & O_NONBLOCK) || seq->seconds == 0) {
+    retval = sleepy_engine_seq_try(&dev->engine, chan, seq->expect,
+				   seq->target, value);
+    if (retval == 0)
+      return seq->seconds ? -EAGAIN : 0;
+    return retval < 0 ? retval : seq->seconds;
+  }
+
+  // A restarted call keeps the deadline of the one a signal interrupted,
+  // so that periodic signals cannot keep it from timing out
+  rs = sleepy_take_restart(dev, filp, chan, seq->seconds, 1);
+  if (rs) {
+    wait = rs->wait;
+    kfree(rs);
+  } else {
+    sleepy_wait_init(&wait, (long)seq->seconds * HZ);
+  }
+
+  s = sleepy_sleeper_enter(dev, chan, wait.deadline,
+			   seq->target ? seq->target : seq->expect + 1);
+  sleepy_nl_event(&dev->events, SLEEPY_EVENT_SLEEP, chan, seq->seconds, 0);
+  retval = sleepy_engine_seq_wait(&dev->engine, chan,
+				  (long)(wait.deadline - jiffies), seq->expect,
+				  seq->target, value);
+  sleepy_sleeper_leave(dev, s);
+  sleepy_sleep_event(dev, chan, retval, value);
+
+  if (retval == -ERESTARTSYS) {
+    if (sleepy_signal_restarts())
+      sleepy_save_restart(dev, filp, chan, seq->seconds, 1, &wait);
+    else
+      retval = -EINTR;
+  }
+  if (retval > 0)
+    retval = retval/HZ;
+  return retval;
+}
+
+ssize_t 
+sleepy_write(struct file *filp, const char __user *buf, size_t count, 
+	     loff_t *f_pos)
+{
+  struct sleepy_seq_wait seq;
+  u64 value;
+
+  // A sequence wait carries the generation the caller last saw
+  if (count == sizeof(seq)) {
+    if (copy_from_user(&seq, buf, sizeof(seq)))
+      return -EFAULT;
+    return sleepy_do_seq_wait(filp, *f_pos, &seq, &value);
+  }
+	
+  // Invalid input - input must be 4 bytes long
+  if (count != 4)
+    return -EINVAL;
+
+  // Copy user input
+  int sleep_seconds, ret;
+  ret = copy_from_user(&sleep_seconds, buf, count);
+  if (ret != 0)
+    return -EINVAL;
+
+  return sleepy_do_sleep(filp, *f_pos, sleep_seconds, &value);
+}
+
+static int
+sleepy_eventfd_notify(struct sleepy_watch *w, unsigned long flag, u64 value)
+{
+  struct sleepy_eventfd *ev = container_of(w, struct sleepy_eventfd, watch);
+
+  // One per generation, so the count keeps pace with SLEEPY_IOC_ADVANCE
+  eventfd_signal(ev->ctx, flag - w->flag);
+  return 0;
+}
+
+/* The registration of 'ctx' on 'dev', if any. Called with sleepy_mutex
+ * held. */
+static struct sleepy_eventfd *
+sleepy_eventfd_find(struct sleepy_dev *dev, struct eventfd_ctx *ctx)
+{
+  struct sleepy_eventfd *ev;
+
+  list_for_each_entry(ev, &dev->eventfds, link)
+    if (ev->ctx == ctx)
+      return ev;
+  return NULL;
+}
+
+static int
+sleepy_eventfd_register(struct sleepy_dev *dev, struct file *filp, int fd)
+{
+  struct eventfd_ctx *ctx;
+  struct sleepy_eventfd *ev;
+  int err;
+
+  ctx = eventfd_ctx_fdget(fd);
+  if (IS_ERR(ctx))
+    return PTR_ERR(ctx);
+
+  ev = kmalloc(sizeof(*ev), GFP_KERNEL);
+  if (ev == NULL) {
+    eventfd_ctx_put(ctx);
+    return -ENOMEM;
+  }
+  ev->ctx = ctx;
+  ev->filp = filp;
+  ev->watch.notify = sleepy_eventfd_notify;
+
+  if (mutex_lock_killable(&dev->sleepy_mutex)) {
+    err = -EINTR;
+    goto fail;
+  }
+  if (sleepy_eventfd_find(dev, ctx))
+    err = -EEXIST;
+  else if (dev->neventfds >= SLEEPY_EVENTFDS_MAX)
+    err = -ENOSPC;
+  else
+    err = sleepy_engine_watch(&dev->engine, &ev->watch);
+  if (err == 0) {
+    list_add_tail(&ev->link, &dev->eventfds);
+    dev->neventfds++;
+  }
+  mutex_unlock(&dev->sleepy_mutex);
+  if (err == 0)
+    return 0;
+
+ fail:
+  eventfd_ctx_put(ctx);
+  kfree(ev);
+  return err;
+}
+
+/* Drop one registration. Called with sleepy_mutex held. */
+static void
+sleepy_eventfd_drop(struct sleepy_dev *dev, struct sleepy_eventfd *ev)
+{
+  sleepy_engine_unwatch(&dev->engine, &ev->watch);
+  list_del(&ev->link);
+  dev->neventfds--;
+  eventfd_ctx_put(ev->ctx);
+  kfree(ev);
+}
+
+static int
+sleepy_eventfd_unregister(struct sleepy_dev *dev, struct file *filp, int fd)
+{
+  struct eventfd_ctx *ctx;
+  struct sleepy_eventfd *ev;
+
+  ctx = eventfd_ctx_fdget(fd);
+  if (IS_ERR(ctx))
+    return PTR_ERR(ctx);
+
+  mutex_lock(&dev->sleepy_mutex);
+  // Only the file that registered it owns it
+  ev = sleepy_eventfd_find(dev, ctx);
+  if (ev && ev->filp != filp)
+    ev = NULL;
+  if (ev)
+    sleepy_eventfd_drop(dev, ev);
+  mutex_unlock(&dev->sleepy_mutex);
+
+  eventfd_ctx_put(ctx);
+  return ev ? 0 : -ENOENT;
+}
+
+/* Relay a fired trigger to its target */
+static void
+sleepy_trigger_fire(struct work_struct *work)
+{
+  struct sleepy_trigger *t = container_of(to_delayed_work(work),
+					  struct sleepy_trigger, work);
+
+  struct sleepy_dev *dev = &sleepy_devices[t->to];
+  u64 value = READ_ONCE(t->value);
+
+  if (sleepy_engine_wake(&dev->engine, value) == 0)
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, 0, 1, value);
+}
+
+/* Runs under the engine lock of the device the edge leaves, so the wake
+ * itself goes to a worker; that also keeps engine locks from nesting
+ * along a chain. */
+static int
+sleepy_trigger_notify(struct sleepy_watch *w, unsigned long flag, u64 value)
+{
+  struct sleepy_trigger *t = container_of(w, struct sleepy_trigger, watch);
+  unsigned long n = flag - w->flag;
+  int fire;
+
+  // SLEEPY_IOC_ADVANCE may move the generation by more than one; the
+  // remainder carries over, and crossing several 'every's fires once
+  fire = n >= t->every - t->count;
+  t->count = (t->count + n % t->every) % t->every;
+  if (!fire)
+    return 0;
+  WRITE_ONCE(t->value, value);
+  queue_delayed_work(system_highpri_wq, &t->work, t->delay);
+  return 0;
+}
+
+/* The edge from 'dev' to 'to', if any. Called with sleepy_trigger_mutex
+ * held. */
+static struct sleepy_trigger *
+sleepy_trigger_find(struct sleepy_dev *dev, unsigned int to)
+{
+  struct sleepy_trigger *t;
+
+  list_for_each_entry(t, &dev->triggers, link)
+    if (t->to == to)
+      return t;
+  return NULL;
+}
+
+/* Can device 'to' already reach device 'from' along trigger edges, so
+ * that an edge from -> to would close a cycle? Returns 1, 0 or -ENOMEM.
+ * Called with sleepy_trigger_mutex held. */
+static int
+sleepy_trigger_reaches(unsigned int to, unsigned int from)
+{
+  struct sleepy_trigger *t;
+  unsigned long *seen;
+  unsigned int *stack;
+  unsigned int n = 0, d;
+  int found = 0;
+
+  // Depth-first; each device is pushed at most once
+  seen = kcalloc(BITS_TO_LONGS(sleepy_ndevices), sizeof(*seen), GFP_KERNEL);
+  stack = kmalloc_array(sleepy_ndevices, sizeof(*stack), GFP_KERNEL);
+  if (seen == NULL || stack == NULL) {
+    found = -ENOMEM;
+    goto out;
+  }
+  __set_bit(to, seen);
+  stack[n++] = to;
+  while (n > 0) {
+    d = stack[--n];
+    if (d == from) {
+      found = 1;
+      break;
+    }
+    list_for_each_entry(t, &sleepy_devices[d].triggers, link)
+      if (!__test_and_set_bit(t->to, seen))
+	stack[n++] = t->to;
+  }
+
+ out:
+  kfree(seen);
+  kfree(stack);
+  return found;
+}
+
+static int
+sleepy_trigger_add(struct sleepy_dev *dev, struct sleepy_trigger_args *args)
+{
+  unsigned int from = dev - sleepy_devices;
+  struct sleepy_trigger *t;
+  int err;
+
+  if (args->to >= sleepy_ndevices || args->flags != 0)
+    return -EINVAL;
+
+  t = kmalloc(sizeof(*t), GFP_KERNEL);
+  if (t == NULL)
+    return -ENOMEM;
+  t->watch.notify = sleepy_trigger_notify;
+  t->to = args->to;
+  t->every = args->every ? args->every : 1;
+  t->count = 0;
+  t->delay = msecs_to_jiffies(args->delay_ms);
+  t->value = 0;
+  INIT_DELAYED_WORK(&t->work, sleepy_trigger_fire);
+
+  if (mutex_lock_killable(&sleepy_trigger_mutex)) {
+    kfree(t);
+    return -EINTR;
+  }
+  if (sleepy_trigger_find(dev, t->to))
+    err = -EEXIST;
+  else
+    err = sleepy_trigger_reaches(t->to, from);
+  if (err > 0)
+    err = -ELOOP;
+  if (err == 0)
+    err = sleepy_engine_watch(&dev->engine, &t->watch);
+  if (err == 0)
+    list_add_tail(&t->link, &dev->triggers);
+  mutex_unlock(&sleepy_trigger_mutex);
+
+  if (err)
+    kfree(t);
+  return err;
+}
+
+/* Remove one edge, waiting for a wake it still had pending. Called with
+ * sleepy_trigger_mutex held. */
+static void
+sleepy_trigger_drop(struct sleepy_dev *dev, struct sleepy_trigger *t)
+{
+  sleepy_engine_unwatch(&dev->engine, &t->watch);
+  cancel_delayed_work_sync(&t->work);
+  list_del(&t->link);
+  kfree(t);
+}
+
+static int
+sleepy_trigger_del(struct sleepy_dev *dev, unsigned int to)
+{
+  struct sleepy_trigger *t;
+
+  mutex_lock(&sleepy_trigger_mutex);
+  t = sleepy_trigger_find(dev, to);
+  if (t)
+    sleepy_trigger_drop(dev, t);
+  mutex_unlock(&sleepy_trigger_mutex);
+  return t ? 0 : -ENOENT;
+}
+
+/* Wake the device of a fired alarm, unless it was cancelled meanwhile */
+static void
+sleepy_alarm_fire(struct work_struct *work)
+{
+  struct sleepy_alarm *a = container_of(work, struct sleepy_alarm, work);
+  struct sleepy_dev *dev = a->dev;
+
+  mutex_lock(&dev->sleepy_mutex);
+  if (list_empty(&a->link)) {
+    // Cancelled; the canceller frees it once we are done
+    mutex_unlock(&dev->sleepy_mutex);
+    return;
+  }
+  list_del_init(&a->link);
+  dev->nalarms--;
+  mutex_unlock(&dev->sleepy_mutex);
+
+  if (sleepy_engine_chan_post(&dev->engine, a->chan, 1, a->value) == 0)
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, a->chan, 1, a->value);
+  kfree(a);
+}
+
+/* The wake needs the engine mutex, so it cannot be done from the timer */
+static enum hrtimer_restart
+sleepy_alarm_expire(struct hrtimer *timer)
+{
+  struct sleepy_alarm *a = container_of(timer, struct sleepy_alarm, timer);
+
+  queue_work(sleepy_alarm_wq, &a->work);
+  return HRTIMER_NORESTART;
+}
+
+static int
+sleepy_alarm_add(struct sleepy_dev *dev, loff_t chan,
+		 struct sleepy_wake_at *at)
+{
+  struct sleepy_alarm *a;
+  u64 expires, now;
+  int err;
+
+  err = sleepy_chan(chan);
+  if (err < 0)
+    return err;
+  if ((at->flags & ~SLEEPY_WAKE_AT_ABS) || at->pad != 0)
+    return -EINVAL;
+  // Past KTIME_MAX the hrtimer would see a negative time, i.e. fire
+  // at once
+  expires = at->time_ns;
+  if (!(at->flags & SLEEPY_WAKE_AT_ABS)) {
+    now = ktime_get_ns();
+    if (expires > KTIME_MAX - now)
+      return -EINVAL;
+    expires += now;
+  } else if (expires > KTIME_MAX) {
+    return -EINVAL;
+  }
+
+  a = kmalloc(sizeof(*a), GFP_KERNEL);
+  if (a == NULL)
+    return -ENOMEM;
+  hrtimer_init(&a->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  a->timer.function = sleepy_alarm_expire;
+  INIT_WORK(&a->work, sleepy_alarm_fire);
+  a->dev = dev;
+  a->chan = chan;
+  a->value = at->value;
+
+  if (mutex_lock_killable(&dev->sleepy_mutex)) {
+    kfree(a);
+    return -EINTR;
+  }
+  if (dev->nalarms >= SLEEPY_ALARMS_MAX) {
+    mutex_unlock(&dev->sleepy_mutex);
+    kfree(a);
+    return -ENOSPC;
+  }
+  a->handle = dev->next_alarm++;
+  list_add_tail(&a->link, &dev->alarms);
+  dev->nalarms++;
+  at->handle = a->handle;
+  hrtimer_start(&a->timer, ns_to_ktime(expires), HRTIMER_MODE_ABS);
+  mutex_unlock(&dev->sleepy_mutex);
+  return 0;
+}
+
+/* Cancel a pending alarm: once it is off the list, a timer or work still
+ * in flight for it does nothing. Called with sleepy_mutex held, which it
+ * drops. */
+static void
+sleepy_alarm_drop(struct sleepy_dev *dev, struct sleepy_alarm *a)
+{
+  list_del_init(&a->link);
+  dev->nalarms--;
+  mutex_unlock(&dev->sleepy_mutex);
+
+  hrtimer_cancel(&a->timer);
+  cancel_work_sync(&a->work);
+  kfree(a);
+}
+
+/* Cancel every pending alarm of 'dev' and wait for those already firing */
+static void
+sleepy_alarm_drop_all(struct sleepy_dev *dev)
+{
+  mutex_lock(&dev->sleepy_mutex);
+  while (!list_empty(&dev->alarms)) {
+    sleepy_alarm_drop(dev, list_first_entry(&dev->alarms,
+					    struct sleepy_alarm, link));
+    mutex_lock(&dev->sleepy_mutex);
+  }
+  mutex_unlock(&dev->sleepy_mutex);
+  flush_workqueue(sleepy_alarm_wq);
+}
+
+static int
+sleepy_alarm_cancel(struct sleepy_dev *dev, u64 handle)
+{
+  struct sleepy_alarm *a;
+
+  mutex_lock(&dev->sleepy_mutex);
+  list_for_each_entry(a, &dev->alarms, link) {
+    if (a->handle == handle) {
+      sleepy_alarm_drop(dev, a);
+      return 0;
+    }
+  }
+  mutex_unlock(&dev->sleepy_mutex);
+  return -ENOENT;
+}
+
+/* Report a device a group wake released, as a WAKE of count 0 */
+static void
+sleepy_group_woken(struct sleepy_engine *eng, u64 value)
+{
+  struct sleepy_dev *dev = container_of(eng, struct sleepy_dev, engine);
+
+  sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, 0, 0, value);
+}
+
+/* Wait for every sleeper to leave the device, releasing them first if
+ * asked to. Returns 0 once it is empty, -ETIMEDOUT or -ERESTARTSYS. */
+static long
+sleepy_drain(struct sleepy_dev *dev, struct sleepy_drain *d)
+{
+  long ret;
+
+  if (d->seconds < 0 || (d->flags & ~SLEEPY_DRAIN_WAKE))
+    return -EINVAL;
+  if (d->flags & SLEEPY_DRAIN_WAKE) {
+    ret = sleepy_engine_release(&dev->engine, d->value);
+    if (ret)
+      return ret;
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, 0, 0, d->value);
+  }
+
+  ret = wait_event_interruptible_timeout(dev->drain_wq,
+					 atomic_read(&dev->sleepers) == 0,
+					 (long)d->seconds * HZ);
+  if (ret < 0)
+    return ret;
+  return ret ? 0 : -ETIMEDOUT;
+}
+
+long
+sleepy_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct sleepy_dev *dev = (struct sleepy_dev *)filp->private_data;
+  struct sleepy_sleep_args sleep_args;
+  struct sleepy_timer_stats stats;
+  struct sleepy_group_wake gwake;
+  struct sleepy_trigger_args trig;
+  struct sleepy_wake_at at;
+  struct sleepy_drain drain;
+  struct sleepy_advance adv;
+  struct sleepy_rate rate;
+  u64 value;
+  long ret;
+  int chan;
+
+  switch (cmd) {
+  case SLEEPY_IOC_WAKE:
+    if (copy_from_user(&value, (u64 __user *)arg, sizeof(value)))
+      return -EFAULT;
+    return sleepy_do_wake(filp, filp->f_pos, 1, value);
+
+  case SLEEPY_IOC_SLEEP:
+    if (copy_from_user(&sleep_args, (void __user *)arg, sizeof(sleep_args)))
+      return -EFAULT;
+    ret = sleepy_do_sleep(filp, filp->f_pos, sleep_args.seconds,
+			  &sleep_args.value);
+    if (ret < 0)
+      return ret;
+    sleep_args.remaining = ret;
+    if (copy_to_user((void __user *)arg, &sleep_args, sizeof(sleep_args)))
+      return -EFAULT;
+    return 0;
+
+  case SLEEPY_IOC_SET_MODE:
+    return sleepy_engine_set_mode(&dev->engine, (int)arg);
+
+  case SLEEPY_IOC_RESET:
+    return sleepy_engine_reset(&dev->engine);
+
+  case SLEEPY_IOC_SET_PARTIES:
+    return sleepy_engine_set_parties(&dev->engine, (unsigned int)arg);
+
+  case SLEEPY_IOC_SET_RATE:
+    if (copy_from_user(&rate, (void __user *)arg, sizeof(rate)))
+      return -EFAULT;
+    return sleepy_engine_set_rate(&dev->engine, rate.rate, rate.burst);
+
+  case SLEEPY_IOC_SET_TIMERS:
+    return sleepy_engine_set_timers(&dev->engine, (int)arg);
+
+  case SLEEPY_IOC_TIMER_STATS:
+    sleepy_engine_timer_stats(&dev->engine, &stats);
+    if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+      return -EFAULT;
+    return 0;
+
+  case SLEEPY_IOC_SET_POLICY:
+    return sleepy_engine_set_policy(&dev->engine, (int)arg);
+
+  case SLEEPY_IOC_GENERATION:
+    chan = sleepy_chan(filp->f_pos);
+    if (chan < 0)
+      return chan;
+    ret = sleepy_engine_generation(&dev->engine, chan, &value);
+    if (ret)
+      return ret;
+    if (copy_to_user((u64 __user *)arg, &value, sizeof(value)))
+      return -EFAULT;
+    return 0;
+
+  case SLEEPY_IOC_SET_GROUP:
+    return sleepy_engine_set_group(&dev->engine, (unsigned int)arg);
+
+  case SLEEPY_IOC_GROUP_WAKE:
+    if (copy_from_user(&gwake, (void __user *)arg, sizeof(gwake)))
+      return -EFAULT;
+    if (gwake.pad != 0)
+      return -EINVAL;
+    return sleepy_groups_wake(&sleepy_groups, gwake.group, gwake.value,
+			      sleepy_group_woken);
+
+  case SLEEPY_IOC_TRIGGER_ADD:
+    if (copy_from_user(&trig, (void __user *)arg, sizeof(trig)))
+      return -EFAULT;
+    return sleepy_trigger_add(dev, &trig);
+
+  case SLEEPY_IOC_TRIGGER_DEL:
+    return sleepy_trigger_del(dev, (unsigned int)arg);
+
+  case SLEEPY_IOC_WAKE_AT:
+    if (copy_from_user(&at, (void __user *)arg, sizeof(at)))
+      return -EFAULT;
+    ret = sleepy_alarm_add(dev, filp->f_pos, &at);
+    if (ret)
+      return ret;
+    if (copy_to_user((void __user *)arg, &at, sizeof(at))) {
+      sleepy_alarm_cancel(dev, at.handle);
+      return -EFAULT;
+    }
+    return 0;
+
+  case SLEEPY_IOC_WAKE_CANCEL:
+    if (copy_from_user(&value, (u64 __user *)arg, sizeof(value)))
+      return -EFAULT;
+    return sleepy_alarm_cancel(dev, value);
+
+  case SLEEPY_IOC_DRAIN:
+    if (copy_from_user(&drain, (void __user *)arg, sizeof(drain)))
+      return -EFAULT;
+    return sleepy_drain(dev, &drain);
+
+  case SLEEPY_IOC_ADVANCE:
+    if (copy_from_user(&adv, (void __user *)arg, sizeof(adv)))
+      return -EFAULT;
+    return sleepy_do_advance(filp, filp->f_pos, &adv);
+
+  case SLEEPY_IOC_EVENTFD_REGISTER:
+    return sleepy_eventfd_register(dev, filp, (int)arg);
+
+  case SLEEPY_IOC_EVENTFD_UNREGISTER:
+    return sleepy_eventfd_unregister(dev, filp, (int)arg);
+
+  default:
+    return -ENOTTY;
+  }
+}
+
+/* The position is the channel that read, write and the WAKE and SLEEP
+ * ioctls act on; SEEK_END counts back from SLEEPY_CHANNELS. */
+loff_t 
+sleepy_llseek(struct file *filp, loff_t off, int whence)
+{
+  loff_t pos;
+
+  switch (whence) {
+  case SEEK_SET:
+    pos = off;
+    break;
+  case SEEK_CUR:
+    pos = filp->f_pos + off;
+    break;
+  case SEEK_END:
+    pos = SLEEPY_CHANNELS + off;
+    break;
+  default:
+    return -EINVAL;
+  }
+  if (sleepy_chan(pos) < 0)
+    return -EINVAL;
+  filp->f_pos = pos;
+  return pos;
+}
+
+struct file_operations sleepy_fops = {
+  .owner =    THIS_MODULE,
+  .read =     sleepy_read,
+  .write =    sleepy_write,
+  .open =     sleepy_open,
+  .release =  sleepy_release,
+  .llseek =   sleepy_llseek,
+  .unlocked_ioctl = sleepy_ioctl,
+};
+
+struct sleepy_engine *
+sleepy_dev_engine(unsigned int minor)
+{
+  if (minor >= sleepy_ndevices)
+    return NULL;
+  return &sleepy_devices[minor].engine;
+}
+
+int
+sleepy_dev_wake(unsigned int minor, u64 value)
+{
+  struct sleepy_dev *dev;
+  int ret;
+
+  if (minor >= sleepy_ndevices)
+    return -ENODEV;
+  dev = &sleepy_devices[minor];
+  ret = sleepy_engine_wake(&dev->engine, value);
+  if (ret == 0)
+    sleepy_nl_event(&dev->events, SLEEPY_EVENT_WAKE, 0, 1, value);
+  return ret;
+}
+
+int
+sleepy_file_minor(struct file *filp)
+{
+  if (filp->f_op != &sleepy_fops)
+    return -EBADF;
+  return iminor(file_inode(filp));
+}
+
+/* debugfs: one line per sleeper, read under RCU so that listing a busy
+ * device never holds up its sleeps and wakes. The tasks are named here
+ * rather than when they go to sleep. */
+static int
+sleepy_sleepers_show(struct seq_file *m, void *unused)
+{
+  struct sleepy_dev *dev = m->private;
+  struct sleepy_sleeper *s;
+  unsigned long now = jiffies;
+  char comm[TASK_COMM_LEN];
+
+  seq_puts(m, "pid comm chan start_ns remaining_ms gen\n");
+  // A task is unlisted before it leaves its sleep, and task_structs are
+  // freed after a grace period, so s->task is safe until the unlock
+  rcu_read_lock();
+  list_for_each_entry_rcu(s, &dev->sleeper_list, link)
+    seq_printf(m, "%d %s %u %llu %u %llu\n", task_pid_nr(s->task),
+	       get_task_comm(comm, s->task), s->chan,
+	       (unsigned long long)s->start,
+	       time_after(s->deadline, now) ?
+	       jiffies_to_msecs(s->deadline - now) : 0,
+	       (unsigned long long)s->gen);
+  rcu_read_unlock();
+  return 0;
+}
+
+static int
+sleepy_sleepers_open(struct inode *inode, struct file *filp)
+{
+  return single_open(filp, sleepy_sleepers_show, inode->i_private);
+}
+
+static const struct file_operations sleepy_sleepers_fops = {
+  .owner =    THIS_MODULE,
+  .open =     sleepy_sleepers_open,
+  .read =     seq_read,
+  .llseek =   seq_lseek,
+  .release =  single_release,
+};
+
+/* ================================================================ */
+/* Setup and register the device with specific index (the index is also
+ * the minor number of the device).
+ * Device class should be created beforehand.
+ */
+static int
+sleepy_construct_device(struct sleepy_dev *dev, int minor, 
+			struct class *class)
+{
+  int err = 0;
+  dev_t devno = MKDEV(sleepy_major, minor);
+  struct device *device = NULL;
+    
+  BUG_ON(dev == NULL || class == NULL);
+
+  /* Memory is to be allocated when the device is opened the first time */
+  dev->data = NULL;     
+  mutex_init(&dev->sleepy_mutex);
+ 
+  // Initialize the wait engine (queue and flag) for each device
+  sleepy_engine_init(&dev->engine);
+  if (sleepy_timer_queue)
+    sleepy_engine_set_timers(&dev->engine, SLEEPY_TIMERS_QUEUE);
+  if (sleepy_timer_cpu >= 0)
+    sleepy_engine_set_timer_cpu(&dev->engine, sleepy_timer_cpu);
+  sleepy_engine_set_groups(&dev->engine, &sleepy_groups);
+  spin_lock_init(&dev->restart_lock);
+  INIT_LIST_HEAD(&dev->restarts);
+  INIT_LIST_HEAD(&dev->eventfds);
+  dev->neventfds = 0;
+  INIT_LIST_HEAD(&dev->triggers);
+  INIT_LIST_HEAD(&dev->alarms);
+  dev->nalarms = 0;
+  dev->next_alarm = 1;
+  atomic_set(&dev->sleepers, 0);
+  init_waitqueue_head(&dev->drain_wq);
+  spin_lock_init(&dev->sleeper_lock);
+  INIT_LIST_HEAD(&dev->sleeper_list);
+  sleepy_nl_batch_init(&dev->events, minor);
+    
+  cdev_init(&dev->cdev, &sleepy_fops);
+  dev->cdev.owner = THIS_MODULE;
+    
+  err = cdev_add(&dev->cdev, devno, 1);
+  if (err)
+    {
+      printk(KERN_WARNING "[target] Error %d while trying to add %s%d",
+	     err, SLEEPY_DEVICE_NAME, minor);
+      goto fail_engine;
+    }
+
+  device = device_create(class, NULL, /* no parent device */ 
+			 devno, NULL, /* no additional data */
+			 SLEEPY_DEVICE_NAME "%d", minor);
+
+  if (IS_ERR(device)) {
+    err = PTR_ERR(device);
+    printk(KERN_WARNING "[target] Error %d while trying to create %s%d",
+	   err, SLEEPY_DEVICE_NAME, minor);
+    cdev_del(&dev->cdev);
+    goto fail_engine;
+  }
+
+  // Debugging aid only: a device without its file works all the same
+  if (sleepy_debugfs)
+    debugfs_create_file(dev_name(device), S_IRUSR, sleepy_debugfs, dev,
+			&sleepy_sleepers_fops);
+  return 0;
+
+ fail_engine:
+  // The caller only destroys the devices before this one, so this one's
+  // engine has to leave its groups and free its timers here
+  sleepy_nl_batch_destroy(&dev->events);
+  sleepy_engine_destroy(&dev->engine);
+  return err;
+}
+
+/* Destroy the device and free its buffer */
+static void
+sleepy_destroy_device(struct sleepy_dev *dev, int minor,
+		      struct class *class)
+{
+  BUG_ON(dev == NULL || class == NULL);
+  device_destroy(class, MKDEV(sleepy_major, minor));
+  cdev_del(&dev->cdev);
+  sleepy_alarm_drop_all(dev);
+  sleepy_nl_batch_destroy(&dev->events);
+  while (!list_empty(&dev->eventfds))
+    sleepy_eventfd_drop(dev, list_first_entry(&dev->eventfds,
+					      struct sleepy_eventfd, link));
+  sleepy_engine_destroy(&dev->engine);
+  kfree(dev->data);
+  return;
+}
+
+/* ================================================================ */
+static void
+sleepy_cleanup_module(int devices_to_destroy)
+{
+  int i;
+	
+  /* Nobody may list sleepers of a device that is going away */
+  debugfs_remove_recursive(sleepy_debugfs);
+
+  /* Get rid of character devices (if any exist) */
+  sleepy_tq_exit(sleepy_class, MKDEV(sleepy_major, sleepy_ndevices));
+
+  if (sleepy_devices) {
+    /* A trigger may still be about to wake any device, so all of them
+     * go before the first device does */
+    mutex_lock(&sleepy_trigger_mutex);
+    for (i = 0; i < devices_to_destroy; ++i)
+      while (!list_empty(&sleepy_devices[i].triggers))
+	sleepy_trigger_drop(&sleepy_devices[i],
+			    list_first_entry(&sleepy_devices[i].triggers,
+					     struct sleepy_trigger, link));
+    mutex_unlock(&sleepy_trigger_mutex);
+
+    for (i = 0; i < devices_to_destroy; ++i) {
+      sleepy_destroy_device(&sleepy_devices[i], i, sleepy_class);
+    }
+    kfree(sleepy_devices);
+  }
+
+  if (sleepy_alarm_wq)
+    destroy_workqueue(sleepy_alarm_wq);
+  sleepy_nl_exit();
+    
+  if (sleepy_class)
+    class_destroy(sleepy_class);
+
+  /* [NB] sleepy_cleanup_module is never called if alloc_chrdev_region()
+   * has failed. */
+  unregister_chrdev_region(MKDEV(sleepy_major, 0), sleepy_ndevices + 1);
+  return;
+}
+
+static int __init
+sleepy_init_module(void)
+{
+  int err = 0;
+  int i = 0;
+  int devices_to_destroy = 0;
+  dev_t dev = 0;
+	
+  if (sleepy_ndevices <= 0)
+    {
+      printk(KERN_WARNING "[target] Invalid value of sleepy_ndevices: %d\n", 
+	     sleepy_ndevices);
+      err = -EINVAL;
+      return err;
+    }
+  if (sleepy_timer_cpu >= 0 &&
+      (sleepy_timer_cpu >= nr_cpu_ids || !cpu_online(sleepy_timer_cpu)))
+    {
+      printk(KERN_WARNING "[target] Invalid value of sleepy_timer_cpu: %d\n",
+	     sleepy_timer_cpu);
+      return -EINVAL;
+    }
+	
+  /* Get a range of minor numbers (starting with 0) to work with; the
+   * timer queue device takes the one after the sleepy devices */
+  err = alloc_chrdev_region(&dev, 0, sleepy_ndevices + 1, SLEEPY_DEVICE_NAME);
+  if (err < 0) {
+    printk(KERN_WARNING "[target] alloc_chrdev_region() failed\n");
+    return err;
+  }
+  sleepy_major = MAJOR(dev);
+
+  /* Create device class (before allocation of the array of devices) */
+  sleepy_class = class_create(THIS_MODULE, SLEEPY_DEVICE_NAME);
+  if (IS_ERR(sleepy_class)) {
+    err = PTR_ERR(sleepy_class);
+    goto fail;
+  }
+	
+  sleepy_groups_init(&sleepy_groups);
+
+  sleepy_debugfs = debugfs_create_dir(SLEEPY_DEVICE_NAME, NULL);
+  if (IS_ERR(sleepy_debugfs))
+    sleepy_debugfs = NULL;
+
+  sleepy_alarm_wq = alloc_workqueue("sleepy_alarm", WQ_HIGHPRI, 0);
+  if (sleepy_alarm_wq == NULL) {
+    err = -ENOMEM;
+    goto fail;
+  }
+
+  /* Devices report events from the moment they exist */
+  err = sleepy_nl_init();
+  if (err)
+    goto fail;
+
+  /* Allocate the array of devices */
+  sleepy_devices = (struct sleepy_dev *)kzalloc(
+						sleepy_ndevices * sizeof(struct sleepy_dev), 
+						GFP_KERNEL);
+  if (sleepy_devices == NULL) {
+    err = -ENOMEM;
+    goto fail;
+  }
+	
+  /* Construct devices */
+  for (i = 0; i < sleepy_ndevices; ++i) {
+    err = sleepy_construct_device(&sleepy_devices[i], i, sleepy_class);
+    if (err) {
+      devices_to_destroy = i;
+      goto fail;
+    }
+  }
+  devices_to_destroy = sleepy_ndevices;
+
+  err = sleepy_tq_init(sleepy_class, MKDEV(sleepy_major, sleepy_ndevices));
+  if (err)
+    goto fail;
+  
+  printk ("sleepy module loaded\n");
+
+  return 0; /* success */
+
+ fail:
+  sleepy_cleanup_module(devices_to_destroy);
+  printk ("sleepy module failed to load\n");
+  return err;
+}
+
+static void __exit
+sleepy_exit_module(void)
+{
+  sleepy_cleanup_module(sleepy_ndevices);
+  printk ("sleepy module unloaded\n");
+  return;
+}
+
+module_init(sleepy_init_module);
+module_exit(sleepy_exit_module);
+/* ================================================================ */
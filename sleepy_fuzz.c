@@ -0,0 +1,308 @@
+/** libFuzzer target for the sleepy wait engine and timing wheel.
+ **
+ ** The first byte picks the target. For the engine, each further byte is
+ ** one operation on one of a few engines; sleeps use a zero timeout so a
+ ** single thread can drive the engine without blocking. RATELIMIT buckets
+ ** refill at one token a second, which a run normally finishes well
+ ** within; once a bucket may have gained a token, its model just follows
+ ** the engine. For the wheel, every three bytes add, cancel or advance,
+ ** checked against a model. Built without -DSLEEPY_LIBFUZZER it becomes
+ ** a plain program that replays the files named on the command line. **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sleepy_core.h"
+#include "sleepy_wheel.h"
+
+#define FUZZ_NENGINES 4
+#define FUZZ_NTIMERS 64
+
+/* Whole tokens in a RATELIMIT engine's bucket */
+static unsigned long
+fuzz_tokens(struct sleepy_engine *eng)
+{
+  return eng->tokens / NSEC_PER_SEC;
+}
+
+static void
+fuzz_engine(const uint8_t *data, size_t size)
+{
+  static struct sleepy_groups groups;
+  struct sleepy_engine engines[FUZZ_NENGINES];
+  struct sleepy_engine *eng;
+  int mode[FUZZ_NENGINES] = { 0 }, signaled[FUZZ_NENGINES] = { 0 };
+  unsigned int parties[FUZZ_NENGINES] = { 1, 1, 1, 1 };
+  u64 last[FUZZ_NENGINES] = { 0 };
+  unsigned long permits[FUZZ_NENGINES] = { 0 };
+  unsigned long tokens[FUZZ_NENGINES], burst[FUZZ_NENGINES];
+  u64 filled[FUZZ_NENGINES];
+  struct sleepy_wait wait;
+  unsigned long flag;
+  unsigned int c;
+  int e, nogen, loose;
+  u64 value;
+  size_t i;
+  long r;
+
+  sleepy_groups_init(&groups);
+  for (i = 0; i < FUZZ_NENGINES; i++) {
+    sleepy_engine_init(&engines[i]);
+    sleepy_engine_set_groups(&engines[i], &groups);
+    tokens[i] = burst[i] = 1;
+    filled[i] = ktime_get_ns();
+  }
+
+  for (i = 0; i < size; i++) {
+    e = data[i] % FUZZ_NENGINES;
+    eng = &engines[e];
+    /* a whole token may soon trickle in since the bucket was filled */
+    loose = mode[e] == SLEEPY_MODE_RATELIMIT &&
+      ktime_get_ns() - filled[e] >= NSEC_PER_SEC / 2;
+
+    switch ((data[i] / FUZZ_NENGINES) % 11) {
+    case 0:
+      flag = eng->flag;
+      if (sleepy_engine_wake(eng, data[i]) != 0 ||
+	  eng->flag != flag + (mode[e] != SLEEPY_MODE_SEMAPHORE &&
+			       mode[e] != SLEEPY_MODE_RATELIMIT))
+	abort();
+      if (mode[e] == SLEEPY_MODE_SEMAPHORE) {
+	permits[e]++;
+	break;
+      }
+      if (mode[e] == SLEEPY_MODE_RATELIMIT) {
+	/* an extra token, but never past the bucket size */
+	tokens[e] = loose ? fuzz_tokens(eng) : min(tokens[e] + 1, burst[e]);
+	if (fuzz_tokens(eng) != tokens[e])
+	  abort();
+	break;
+      }
+      signaled[e] = mode[e] == SLEEPY_MODE_LATCHED;
+      last[e] = data[i];
+      break;
+    case 1:
+      /* nothing else can wake us, so a zero-timeout sleep must time out
+       * unless a latched signal is pending, we complete a barrier, or a
+       * permit or token is free; the lockless probe must agree */
+      if (data[i] & 0x80)
+	r = sleepy_engine_try(eng, 0, &value);
+      else
+	r = sleepy_engine_sleep(eng, 0, &value);
+      if (signaled[e] ? r != 1 || value != last[e]
+	  : mode[e] == SLEEPY_MODE_BARRIER && parties[e] == 1 ? r != 1
+	  : mode[e] == SLEEPY_MODE_SEMAPHORE && permits[e] > 0 ? r != 1
+	  : mode[e] == SLEEPY_MODE_RATELIMIT && (tokens[e] > 0 || loose)
+	  ? (r != 1 && !loose) || value != 0
+	  : r != 0 || value != 0)
+	abort();
+      if (mode[e] == SLEEPY_MODE_SEMAPHORE && permits[e] > 0)
+	permits[e]--;
+      if (mode[e] == SLEEPY_MODE_RATELIMIT)
+	tokens[e] = loose ? fuzz_tokens(eng) : tokens[e] - (tokens[e] > 0);
+      if (eng->permits != permits[e] ||
+	  (mode[e] == SLEEPY_MODE_RATELIMIT && fuzz_tokens(eng) != tokens[e]))
+	abort();
+      break;
+    case 2:
+      /* every mode, RATELIMIT included; a new mode starts with no
+       * permits and a full bucket */
+      c = (data[i] >> 5) % 5;
+      if (mode[e] != c) {
+	permits[e] = 0;
+	tokens[e] = burst[e];
+	filled[e] = ktime_get_ns();
+      }
+      mode[e] = c;
+      signaled[e] = 0;
+      if (sleepy_engine_set_mode(eng, mode[e]) != 0)
+	abort();
+      break;
+    case 3:
+      signaled[e] = 0;
+      if (sleepy_engine_reset(eng) != 0)
+	abort();
+      break;
+    case 4:
+      parties[e] = (data[i] >> 6) + 1;
+      if (sleepy_engine_set_parties(eng, parties[e]) != 0 ||
+	  eng->arrived != 0)
+	abort();
+      break;
+    case 5:
+      if (sleepy_engine_set_timers(eng, data[i] >> 7) != 0)
+	abort();
+      break;
+    case 6:
+      if (sleepy_engine_set_policy(eng, data[i] >> 6) != 0)
+	abort();
+      break;
+    case 7:
+      /* a sub-channel sleep times out unless its channel was woken since
+       * it last looked, whatever the engine's mode */
+      c = 1 + (data[i] >> 5);
+      sleepy_wait_init(&wait, 0);
+      if (sleepy_engine_chan_wait(eng, c, &wait, &value) != 0 || value != 0)
+	abort();
+      if (sleepy_engine_chan_post(eng, c, 1, data[i]) != 0 ||
+	  sleepy_engine_chan_wait(eng, c, &wait, &value) != 1 ||
+	  value != data[i])
+	abort();
+      break;
+    case 8:
+      /* sequence waits: a stale expectation returns at once, a current
+       * one times out; then an advance by n moves the generation by n,
+       * and a post of any count by 1 */
+      c = (data[i] >> 5) & 1;
+      if (sleepy_engine_generation(eng, c, &value) != 0)
+	abort();
+      flag = value;
+      nogen = c == 0 && (mode[e] == SLEEPY_MODE_SEMAPHORE ||
+			 mode[e] == SLEEPY_MODE_RATELIMIT);
+      r = sleepy_engine_seq_wait(eng, c, 0, flag - 1, 0, &value);
+      if (nogen ? r != -EINVAL : r != 1)
+	abort();
+      r = sleepy_engine_seq_wait(eng, c, 0, flag, flag + 2, &value);
+      if (nogen ? r != -EINVAL : r != 0 || value != 0)
+	abort();
+      if (nogen)
+	break;
+      if (data[i] >> 6 == 0) {
+	if (sleepy_engine_chan_advance(eng, c, 0, data[i]) != -EINVAL ||
+	    sleepy_engine_chan_post(eng, c, 3, data[i]) != 0)
+	  abort();
+      } else if (sleepy_engine_chan_advance(eng, c, data[i] >> 6,
+					    data[i]) != 0) {
+	abort();
+      }
+      if (sleepy_engine_generation(eng, c, &value) != 0 ||
+	  value != flag + max(data[i] >> 6, 1))
+	abort();
+      if (c == 0) {
+	signaled[e] = mode[e] == SLEEPY_MODE_LATCHED;
+	last[e] = data[i];
+      }
+      break;
+    case 9:
+      /* group wakes and releases are not latched: they must not disturb
+       * any later sleep, whatever group the engine is in */
+      if ((data[i] & 0x80 ? sleepy_engine_set_group(eng, data[i] >> 5)
+	   : (data[i] & 0x60) == 0x60 ? sleepy_engine_release(eng, data[i])
+	   : sleepy_groups_wake(&groups, (data[i] >> 5) & 3, data[i],
+				 NULL)) != 0)
+	abort();
+      break;
+    case 10:
+      /* a new rate or burst refills the bucket; a rate of 0 is refused */
+      if (data[i] & 0x80) {
+	if (sleepy_engine_set_rate(eng, 0, 1) != -EINVAL)
+	  abort();
+	break;
+      }
+      burst[e] = (data[i] >> 5) & 3 ? (data[i] >> 5) & 3 : 1;
+      if (sleepy_engine_set_rate(eng, 1, (data[i] >> 5) & 3) != 0)
+	abort();
+      tokens[e] = burst[e];
+      filled[e] = ktime_get_ns();
+      break;
+    }
+  }
+
+  for (i = 0; i < FUZZ_NENGINES; i++)
+    sleepy_engine_destroy(&engines[i]);
+}
+
+static void
+fuzz_wheel(const uint8_t *data, size_t size)
+{
+  static struct sleepy_wheel wh;
+  struct sleepy_wheel_timer timers[FUZZ_NTIMERS], *t;
+  int pending[FUZZ_NTIMERS] = { 0 };
+  struct list_head expired;
+  u64 target, next;
+  size_t i;
+  int k;
+
+  if (size == 0)
+    return;
+  sleepy_wheel_init(&wh, data[0] | (u64)data[0] << 40);
+  for (i = 0; i + 3 <= size; i += 3) {
+    k = data[i + 1] % FUZZ_NTIMERS;
+    switch (data[i] % 3) {
+    case 0:
+      /* distances from already-due to well past the wheel's horizon */
+      if (pending[k])
+	break;
+      timers[k].expires = wh.now + ((u64)data[i + 2] << (data[i + 1] % 40))
+	- (data[i] & 0x80 ? 2 : 0);
+      sleepy_wheel_add(&wh, &timers[k]);
+      pending[k] = 1;
+      break;
+    case 1:
+      if (!pending[k])
+	break;
+      sleepy_wheel_del(&wh, &timers[k]);
+      pending[k] = 0;
+      break;
+    case 2:
+      target = wh.now + ((u64)data[i + 2] << (data[i + 1] % 13));
+      next = wh.count ? sleepy_wheel_next(&wh) : target + 1;
+      INIT_LIST_HEAD(&expired);
+      sleepy_wheel_advance(&wh, target, &expired);
+      if (wh.now != target + 1)
+	abort();
+      /* nothing may fall due before the tick the wheel said it needs */
+      if (next > target && !list_empty(&expired))
+	abort();
+      list_for_each_entry(t, &expired, link) {
+	k = t - timers;
+	if (!pending[k] || t->expires > target)
+	  abort();
+	pending[k] = 0;
+      }
+      /* whatever is still pending must not be due yet */
+      for (k = 0; k < FUZZ_NTIMERS; k++)
+	if (pending[k] && timers[k].expires <= target)
+	  abort();
+      break;
+    }
+  }
+
+  for (k = 0, i = 0; k < FUZZ_NTIMERS; k++)
+    i += pending[k];
+  if (wh.count != i)
+    abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size == 0)
+    return 0;
+  if (data[0] & 1)
+    fuzz_wheel(data + 1, size - 1);
+  else
+    fuzz_engine(data + 1, size - 1);
+  return 0;
+}
+
+#ifndef SLEEPY_LIBFUZZER
+int main(int argc, char **argv) {
+  static uint8_t buf[1 << 16];
+  FILE *f;
+  size_t n;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    f = fopen(argv[i], "rb");
+    if (f == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    n = fread(buf, 1, sizeof buf, f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, n);
+  }
+  return 0;
+}
+#endif
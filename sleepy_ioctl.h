@@ -0,0 +1,425 @@
+/* sleepy_ioctl.h - ioctl interface of the sleepy devices, shared by the
+ * module and userspace programs.
+ */
+
+#ifndef SLEEPY_IOCTL_H_1727_INCLUDED
+#define SLEEPY_IOCTL_H_1727_INCLUDED
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SLEEPY_IOC_MAGIC 'z'
+
+/* Argument of SLEEPY_IOC_SLEEP, the ioctl form of write().
+ *  seconds - in: timeout, as written to the device;
+ *  remaining - out: seconds left when woken, 0 on timeout;
+ *  value - out: value attached by the wake that ended the sleep
+ *    (0 on timeout or for plain read() wakes).
+ */
+struct sleepy_sleep_args {
+  __s32 seconds;
+  __s32 remaining;
+  __u64 value;
+};
+
+/* A sequence wait: write() this instead of the 4-byte timeout to sleep
+ * only if the generation of the channel (SLEEPY_IOC_GENERATION) is still
+ * 'expect', and then until it reaches 'target', so that no wake between
+ * reading the generation and sleeping is lost. Returns at once, as if
+ * woken, when the generation is not 'expect'. Not for SEMAPHORE or
+ * RATELIMIT devices, whose generation does not move.
+ *  seconds - timeout;
+ *  flags - must be 0;
+ *  expect - generation the caller last saw;
+ *  target - generation to wait for (wrapping compare); 0 means
+ *    expect + 1, i.e. the next wake.
+ */
+struct sleepy_seq_wait {
+  __s32 seconds;
+  __u32 flags;
+  __u64 expect;
+  __u64 target;
+};
+
+/* Argument of SLEEPY_IOC_ADVANCE.
+ *  count - generations to advance by, at least 1;
+ *  value - handed to the sleepers woken.
+ */
+struct sleepy_advance {
+  __u64 count;
+  __u64 value;
+};
+
+/* Device groups. Every device is in group 0; SLEEPY_IOC_SET_GROUP also
+ * puts it in one of groups 1 to SLEEPY_GROUPS - 1. */
+#define SLEEPY_GROUPS 64
+
+/* Argument of SLEEPY_IOC_GROUP_WAKE.
+ *  group - group to wake;
+ *  pad - must be 0;
+ *  value - handed to every sleeper released.
+ */
+struct sleepy_group_wake {
+  __u32 group;
+  __u32 pad;
+  __u64 value;
+};
+
+/* Argument of SLEEPY_IOC_TRIGGER_ADD: an edge from the device the ioctl
+ * is issued on to another one, which then gets woken, with the same
+ * value, whenever the first one starts a new generation.
+ *  to - minor of the device to wake;
+ *  every - only on every 'every'-th new generation (0 means 1);
+ *  delay_ms - this long afterwards (a wake still pending absorbs
+ *    further ones);
+ *  flags - must be 0.
+ */
+struct sleepy_trigger_args {
+  __u32 to;
+  __u32 every;
+  __u32 delay_ms;
+  __u32 flags;
+};
+
+/* Argument of SLEEPY_IOC_WAKE_AT.
+ *  time_ns - in: CLOCK_MONOTONIC time of the wake, in nanoseconds from
+ *    now, or absolute with SLEEPY_WAKE_AT_ABS;
+ *  value - in: handed to the sleepers woken;
+ *  flags - in: SLEEPY_WAKE_AT_*;
+ *  pad - must be 0;
+ *  handle - out: identifies the wake to SLEEPY_IOC_WAKE_CANCEL.
+ */
+struct sleepy_wake_at {
+  __u64 time_ns;
+  __u64 value;
+  __u32 flags;
+  __u32 pad;
+  __u64 handle;
+};
+
+#define SLEEPY_WAKE_AT_ABS 1
+
+/* Argument of SLEEPY_IOC_DRAIN.
+ *  seconds - longest to wait for the device to empty (0 just checks);
+ *  flags - SLEEPY_DRAIN_*;
+ *  value - with SLEEPY_DRAIN_WAKE, handed to the sleepers released.
+ */
+struct sleepy_drain {
+  __s32 seconds;
+  __u32 flags;
+  __u64 value;
+};
+
+/* Release every sleeper first, in any mode and on any channel */
+#define SLEEPY_DRAIN_WAKE 1
+
+/* Event stream on the generic netlink family SLEEPY_NL_FAMILY. Device
+ * N's events are multicast to group "sleepyM", M = N % SLEEPY_NL_GROUPS,
+ * in SLEEPY_NL_C_EVENTS messages whose SLEEPY_NL_A_EVENTS attribute is
+ * an array of struct sleepy_event; SLEEPY_NL_A_LOST, if present, counts
+ * the events dropped on that device since its previous message. */
+#define SLEEPY_NL_FAMILY  "sleepy"
+#define SLEEPY_NL_VERSION 1
+#define SLEEPY_NL_GROUPS  32
+
+#define SLEEPY_NL_C_EVENTS 1
+
+#define SLEEPY_NL_A_EVENTS 1 /* binary: struct sleepy_event[] */
+#define SLEEPY_NL_A_LOST   2 /* __u32 */
+#define SLEEPY_NL_A_MAX    2
+
+/* One event.
+ *  time_ns - CLOCK_MONOTONIC time it happened;
+ *  value - wake value (WAKE and WOKEN, else 0);
+ *  pid - task that caused it (a kernel worker for scheduled and
+ *    triggered wakes);
+ *  chan - channel concerned;
+ *  minor - device concerned;
+ *  type - SLEEPY_EVENT_*;
+ *  arg - SLEEP: timeout in seconds; WAKE: count, 0 for a release of
+ *    every sleeper (group wakes and SLEEPY_DRAIN_WAKE); WOKEN: seconds
+ *    left; INTERRUPT: the negative error (-512, ERESTARTSYS, for a
+ *    signal).
+ */
+struct sleepy_event {
+  __u64 time_ns;
+  __u64 value;
+  __u32 pid;
+  __u32 chan;
+  __u16 minor;
+  __u16 type;
+  __s32 arg;
+};
+
+/* Event types. SLEEP starts a blocking sleep, which ends in exactly one
+ * of WOKEN, TIMEOUT or INTERRUPT (by a signal or an error). */
+#define SLEEPY_EVENT_SLEEP     1
+#define SLEEPY_EVENT_WOKEN     2
+#define SLEEPY_EVENT_TIMEOUT   3
+#define SLEEPY_EVENT_INTERRUPT 4
+#define SLEEPY_EVENT_WAKE      5
+
+/* Device modes, selected with SLEEPY_IOC_SET_MODE.
+ *  EDGE - a wake only releases the sleepers present at that moment;
+ *  LATCHED - a wake stays set until SLEEPY_IOC_RESET, and sleepers
+ *    arriving while it is set return immediately;
+ *  BARRIER - sleepers park until SLEEPY_IOC_SET_PARTIES of them have
+ *    arrived, then all are released and a new phase starts. A sleeper
+ *    that times out leaves the phase; read() releases it early;
+ *  SEMAPHORE - read() adds 'count' permits (at least one) and each
+ *    sleeper takes one, handed over in arrival order; a sleeper that
+ *    times out never consumed a permit;
+ *  RATELIMIT - token bucket: each sleeper takes one token, waiting in
+ *    arrival order until one accrues (SLEEPY_IOC_SET_RATE); read() adds
+ *    'count' tokens up to the burst size.
+ */
+#define SLEEPY_MODE_EDGE    0
+#define SLEEPY_MODE_LATCHED 1
+#define SLEEPY_MODE_BARRIER 2
+#define SLEEPY_MODE_SEMAPHORE 3
+#define SLEEPY_MODE_RATELIMIT 4
+
+/* Argument of SLEEPY_IOC_SET_RATE.
+ *  rate - tokens added per second (at least 1);
+ *  burst - most tokens the bucket holds (0 means 1).
+ */
+struct sleepy_rate {
+  __u32 rate;
+  __u32 burst;
+};
+
+/* How sleepers in EDGE, LATCHED and BARRIER modes time out, selected
+ * with SLEEPY_IOC_SET_TIMERS.
+ *  SLEEPER - each sleeper arms its own timer (the default);
+ *  QUEUE - sleepers sit in a per-device queue ordered by deadline, served
+ *    by one hrtimer armed for the earliest; one expiry times out every
+ *    sleeper that is due.
+ */
+#define SLEEPY_TIMERS_SLEEPER 0
+#define SLEEPY_TIMERS_QUEUE   1
+
+/* Result of SLEEPY_IOC_TIMER_STATS, counting since the device was created.
+ *  expiries - deadline-queue timer interrupts;
+ *  housekeeping - those that ran on the timer CPU (sleepy_timer_cpu);
+ *  remote_arms - times a timer armed on another CPU was handed over to
+ *    the timer CPU.
+ */
+struct sleepy_timer_stats {
+  __u64 expiries;
+  __u64 housekeeping;
+  __u64 remote_arms;
+};
+
+/* Which sleeper an exclusive wake (a SEMAPHORE permit) goes to, selected
+ * with SLEEPY_IOC_SET_POLICY.
+ *  FIFO - the one that has waited longest (the default);
+ *  LIFO - the one parked most recently, whose stack and caches are still
+ *    warm; under light load the same few sleepers keep being reused and
+ *    the rest stay asleep;
+ *  LOCAL - the oldest sleeper that parked on the waker's CPU, else on the
+ *    waker's NUMA node, else the oldest overall;
+ *  PRIO - the highest-priority sleeper (real-time before normal, then by
+ *    nice value), oldest first among equals. Broadcast wakes in the other
+ *    modes then also reach sleepers in priority order.
+ */
+#define SLEEPY_POLICY_FIFO  0
+#define SLEEPY_POLICY_LIFO  1
+#define SLEEPY_POLICY_LOCAL 2
+#define SLEEPY_POLICY_PRIO  3
+
+/* Channels of a device, selected by the file position (lseek(), or the
+ * offset of pread()/pwrite()) that read, write, SLEEPY_IOC_WAKE and
+ * SLEEPY_IOC_SLEEP act on. Channel 0 is the device itself, with its mode
+ * and everything else set by ioctl; each other channel is an independent
+ * EDGE generation, so one open file can sleep on or wake any of them. */
+#define SLEEPY_CHANNELS 4096
+
+/* Wake every sleeper like read() does, handing each of them the __u64
+ * pointed to by the argument. */
+#define SLEEPY_IOC_WAKE  _IOW(SLEEPY_IOC_MAGIC, 1, __u64)
+#define SLEEPY_IOC_SLEEP _IOWR(SLEEPY_IOC_MAGIC, 2, struct sleepy_sleep_args)
+
+/* Select the device mode; the argument is the SLEEPY_MODE_* value
+ * itself. Leaving LATCHED mode clears a pending signal. */
+#define SLEEPY_IOC_SET_MODE _IO(SLEEPY_IOC_MAGIC, 3)
+/* Clear the signal of a LATCHED device. */
+#define SLEEPY_IOC_RESET    _IO(SLEEPY_IOC_MAGIC, 4)
+/* Set the BARRIER party count; the argument is the count itself. */
+#define SLEEPY_IOC_SET_PARTIES _IO(SLEEPY_IOC_MAGIC, 5)
+/* Configure the RATELIMIT token bucket; it starts out full. */
+#define SLEEPY_IOC_SET_RATE _IOW(SLEEPY_IOC_MAGIC, 6, struct sleepy_rate)
+/* Select SLEEPY_TIMERS_*; the argument is the value itself. */
+#define SLEEPY_IOC_SET_TIMERS _IO(SLEEPY_IOC_MAGIC, 7)
+/* Signal the eventfd whose descriptor is the argument on every new
+ * generation of the device (every wake in EDGE, LATCHED and BARRIER
+ * modes), adding 1 to its counter; EEXIST if it is already registered.
+ * The registration belongs to the open file and ends when it is closed. */
+#define SLEEPY_IOC_EVENTFD_REGISTER   _IO(SLEEPY_IOC_MAGIC, 8)
+/* Stop signalling that eventfd; ENOENT if it was not registered through
+ * this open file. */
+#define SLEEPY_IOC_EVENTFD_UNREGISTER _IO(SLEEPY_IOC_MAGIC, 9)
+/* Select SLEEPY_POLICY_*; the argument is the value itself. */
+#define SLEEPY_IOC_SET_POLICY _IO(SLEEPY_IOC_MAGIC, 10)
+/* Store the device's struct sleepy_timer_stats, to see how often its
+ * deadline-queue timer fires and where. */
+#define SLEEPY_IOC_TIMER_STATS _IOR(SLEEPY_IOC_MAGIC, 11, struct sleepy_timer_stats)
+/* Store the current generation of the selected channel, which every wake
+ * advances by 1 in EDGE, LATCHED and BARRIER modes and on channels other
+ * than 0 (SLEEPY_IOC_ADVANCE by more). */
+#define SLEEPY_IOC_GENERATION _IOR(SLEEPY_IOC_MAGIC, 12, __u64)
+/* Move the device to the group that is the argument (0 for none but
+ * group 0). Later group wakes reach its sleepers by the new group,
+ * including those already parked. */
+#define SLEEPY_IOC_SET_GROUP _IO(SLEEPY_IOC_MAGIC, 13)
+/* Release every sleeper on every device of a group, in any mode and on
+ * any channel, as if woken. Device generations do not move, so this
+ * neither signals eventfds nor satisfies sequence waits elsewhere;
+ * sleepers that arrive afterwards sleep as usual. Any sleepy device
+ * can be used to issue it. There is no group generation: the call visits
+ * the group's devices one by one, taking each one's lock while it holds
+ * the group's, so it costs O(devices in the group) and waits for any of
+ * them that is busy. Sleeps in turn never touch group state. */
+#define SLEEPY_IOC_GROUP_WAKE _IOW(SLEEPY_IOC_MAGIC, 14, struct sleepy_group_wake)
+/* Add a trigger edge; EEXIST if there already is one to that device, and
+ * ELOOP if it would close a cycle. */
+#define SLEEPY_IOC_TRIGGER_ADD _IOW(SLEEPY_IOC_MAGIC, 15, struct sleepy_trigger_args)
+/* Remove the edge to the device whose minor is the argument; ENOENT if
+ * there is none. */
+#define SLEEPY_IOC_TRIGGER_DEL _IO(SLEEPY_IOC_MAGIC, 16)
+/* Schedule a wake of the selected channel, like read() with 'value',
+ * at a future time; a time already past wakes at once. EINVAL for a time
+ * beyond KTIME_MAX, ENOSPC if the device has too many pending. Scheduled
+ * wakes belong to the device and outlive the file. */
+#define SLEEPY_IOC_WAKE_AT _IOWR(SLEEPY_IOC_MAGIC, 17, struct sleepy_wake_at)
+/* Cancel the scheduled wake whose __u64 handle the argument points to;
+ * ENOENT if it has already happened or never existed. */
+#define SLEEPY_IOC_WAKE_CANCEL _IOW(SLEEPY_IOC_MAGIC, 18, __u64)
+/* Wait until nobody is sleeping on the device, or ETIMEDOUT. Sleepers
+ * arriving in the meantime are waited for as well, so stop new ones
+ * first. */
+#define SLEEPY_IOC_DRAIN _IOW(SLEEPY_IOC_MAGIC, 19, struct sleepy_drain)
+/* Advance the generation of the selected channel by 'count' with a single
+ * wake, so that sequence waiters for up to 'count' generations ahead are
+ * released together; registered eventfds get 'count' added. EINVAL for
+ * a count of 0 or channel 0 of a SEMAPHORE or RATELIMIT device. */
+#define SLEEPY_IOC_ADVANCE _IOW(SLEEPY_IOC_MAGIC, 20, struct sleepy_advance)
+
+/* Timer queue device (/dev/sleepytq). write() takes an array of these,
+ * arming each id for its deadline, or moving it if already armed.
+ *  id - caller's cookie, returned by read() once the timer expires;
+ *  deadline_ns - absolute CLOCK_MONOTONIC expiry time, in nanoseconds
+ *    (served with millisecond resolution).
+ */
+struct sleepy_tq_entry {
+  __u64 id;
+  __u64 deadline_ns;
+};
+
+/* Cancel the timer with the __u64 id pointed to by the argument, whether
+ * pending or expired but not yet read; ENOENT if there is none. */
+#define SLEEPY_TQ_IOC_CANCEL _IOW(SLEEPY_IOC_MAGIC, 32, __u64)
+
+/* Shared-memory rings on a timer queue file, set up once with
+ * SLEEPY_TQ_IOC_SETUP_RINGS and then mmap()ed (offset 0, params.size
+ * bytes). The mapping starts with a struct sleepy_ring_hdr, followed by
+ * the submission array at sq_off and the completion array at cq_off.
+ * Userspace fills SQEs at sq_tail and publishes them by advancing
+ * sq_tail; the kernel consumes them at sq_head. The kernel posts CQEs at
+ * cq_tail and userspace consumes them by advancing cq_head. Indices run
+ * freely and are masked with sq_mask/cq_mask. The kernel stops taking
+ * SQEs while their completions might not fit, so the CQ never overflows.
+ */
+
+/* Operations (sleepy_sqe.opcode).
+ *  TIMEOUT - complete with -ETIME at the absolute CLOCK_MONOTONIC time
+ *    'arg' (ns);
+ *  WAIT - complete with 0 and the wake value at the next generation of
+ *    device /dev/sleepy'dev', or with -ETIME at time 'arg' if it is not 0;
+ *    -EACCES unless the device was added with SLEEPY_TQ_IOC_ADD_DEV, and
+ *    -ENOSPC if the queue holds sleepy_tq_max_timers already (as does a
+ *    TIMEOUT);
+ *  CANCEL - cancel the TIMEOUT or WAIT whose user_data is 'arg', which
+ *    completes with -ECANCELED; the CANCEL itself completes with 0,
+ *    -ENOENT, or -EALREADY if the target was already completing;
+ *  SIGNAL - wake device /dev/sleepy'dev' like SLEEPY_IOC_WAKE with value
+ *    'arg', and complete with 0; -EACCES as for WAIT.
+ * Every SQE gets exactly one CQE; TIMEOUT and WAIT ops are looked up by
+ * user_data, which should be unique among those in flight.
+ */
+#define SLEEPY_OP_TIMEOUT 1
+#define SLEEPY_OP_WAIT    2
+#define SLEEPY_OP_CANCEL  3
+#define SLEEPY_OP_SIGNAL  4
+
+struct sleepy_sqe {
+  __u8 opcode;
+  __u8 pad[3];
+  __u32 dev;
+  __u64 user_data;
+  __u64 arg;
+};
+
+/* res - 0 or a negative errno as described above;
+ * value - wake value, for WAIT. */
+struct sleepy_cqe {
+  __u64 user_data;
+  __s32 res;
+  __u32 pad;
+  __u64 value;
+};
+
+/* sq_head and cq_tail are written by the kernel, sq_tail and cq_head by
+ * userspace; flags holds SLEEPY_RING_NEED_WAKEUP. */
+struct sleepy_ring_hdr {
+  __u32 sq_head;
+  __u32 sq_tail;
+  __u32 sq_mask;
+  __u32 cq_head;
+  __u32 cq_tail;
+  __u32 cq_mask;
+  __u32 flags;
+  __u32 pad;
+};
+
+/* The polling worker has gone idle: submissions wait for
+ * SLEEPY_TQ_IOC_ENTER until it is woken again. */
+#define SLEEPY_RING_NEED_WAKEUP 1
+
+/* Argument of SLEEPY_TQ_IOC_SETUP_RINGS.
+ *  sq_entries - in: submission slots wanted, out: rounded up to a power
+ *    of two (at most 32768);
+ *  cq_entries - likewise for completions; 0 means twice sq_entries;
+ *  flags - SLEEPY_RING_SQPOLL: a kernel worker drains the SQ without
+ *    being asked, until it has seen nothing for a second;
+ *  sq_off, cq_off, size - out: layout of the mapping.
+ */
+struct sleepy_ring_params {
+  __u32 sq_entries;
+  __u32 cq_entries;
+  __u32 flags;
+  __u32 sq_off;
+  __u32 cq_off;
+  __u32 size;
+};
+
+#define SLEEPY_RING_SQPOLL 1
+
+/* Argument of SLEEPY_TQ_IOC_ENTER.
+ *  to_submit - SQEs to consume now (also wakes an idle polling worker);
+ *  min_complete - then wait until at least this many CQEs are unread.
+ */
+struct sleepy_ring_enter {
+  __u32 to_submit;
+  __u32 min_complete;
+};
+
+#define SLEEPY_TQ_IOC_SETUP_RINGS \
+  _IOWR(SLEEPY_IOC_MAGIC, 33, struct sleepy_ring_params)
+/* Returns the number of SQEs consumed. */
+#define SLEEPY_TQ_IOC_ENTER _IOW(SLEEPY_IOC_MAGIC, 34, struct sleepy_ring_enter)
+/* Let WAIT and SIGNAL ops use the sleepy device open as the file
+ * descriptor that is the argument, for as long as the queue is open;
+ * EBADF if it is not a sleepy device. */
+#define SLEEPY_TQ_IOC_ADD_DEV _IO(SLEEPY_IOC_MAGIC, 35)
+
+#endif /* SLEEPY_IOCTL_H_1727_INCLUDED */
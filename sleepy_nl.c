@@ -0,0 +1,150 @@
+/* sleepy_nl.c - generic netlink event stream of the sleepy devices.
+ *
+ * Each device collects its events in a small batch, which a work item
+ * multicasts as one message shortly after the first event comes in, or
+ * as soon as the batch fills up. Listeners pick devices by joining their
+ * multicast groups. Every event first checks whether anyone listens to
+ * its group, which is a bit test, and does nothing else when nobody does.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <net/genetlink.h>
+#include <net/net_namespace.h>
+
+#include "sleepy_nl.h"
+
+/* How long the first event of a batch may wait for company */
+#define SLEEPY_NL_DELAY_MS 10
+
+/* Named "sleepy0" to "sleepyN" when the family is registered */
+static struct genl_multicast_group sleepy_nl_groups[SLEEPY_NL_GROUPS];
+
+static struct genl_family sleepy_nl_family = {
+  .name = SLEEPY_NL_FAMILY,
+  .version = SLEEPY_NL_VERSION,
+  .maxattr = SLEEPY_NL_A_MAX,
+  .module = THIS_MODULE,
+  .mcgrps = sleepy_nl_groups,
+  .n_mcgrps = SLEEPY_NL_GROUPS,
+};
+
+static int sleepy_nl_registered = 0;
+
+int
+sleepy_nl_init(void)
+{
+  int i, err;
+
+  for (i = 0; i < SLEEPY_NL_GROUPS; i++)
+    snprintf(sleepy_nl_groups[i].name, GENL_NAMSIZ, "sleepy%d", i);
+  err = genl_register_family(&sleepy_nl_family);
+  if (err == 0)
+    sleepy_nl_registered = 1;
+  return err;
+}
+
+void
+sleepy_nl_exit(void)
+{
+  if (sleepy_nl_registered)
+    genl_unregister_family(&sleepy_nl_family);
+  sleepy_nl_registered = 0;
+}
+
+/* Send whatever the batch holds */
+static void
+sleepy_nl_flush(struct work_struct *work)
+{
+  struct sleepy_nl_batch *b = container_of(to_delayed_work(work),
+					   struct sleepy_nl_batch, work);
+  struct sk_buff *skb;
+  unsigned int n;
+  void *hdr;
+  u32 lost;
+  int err;
+
+  // Allocate for a full batch up front, so the copy under the lock
+  // cannot fail
+  skb = genlmsg_new(nla_total_size(sizeof(b->events)) +
+		    nla_total_size(sizeof(u32)), GFP_KERNEL);
+  hdr = skb ? genlmsg_put(skb, 0, 0, &sleepy_nl_family, 0,
+			  SLEEPY_NL_C_EVENTS) : NULL;
+
+  spin_lock(&b->lock);
+  n = b->n;
+  lost = b->lost;
+  err = -ENOMEM;
+  if (hdr) {
+    err = nla_put(skb, SLEEPY_NL_A_EVENTS, n * sizeof(b->events[0]),
+		  b->events);
+    if (err == 0 && lost)
+      err = nla_put_u32(skb, SLEEPY_NL_A_LOST, lost);
+  }
+  // Without a message the events are lost, and reported as such next time
+  b->n = 0;
+  b->lost = err ? lost + n : 0;
+  spin_unlock(&b->lock);
+
+  if (err || (n == 0 && lost == 0)) {
+    nlmsg_free(skb);
+    return;
+  }
+  genlmsg_end(skb, hdr);
+  // Nobody may be listening by now, which is fine
+  genlmsg_multicast(&sleepy_nl_family, skb, 0, b->group, GFP_KERNEL);
+}
+
+void
+sleepy_nl_batch_init(struct sleepy_nl_batch *b, unsigned int minor)
+{
+  spin_lock_init(&b->lock);
+  b->minor = minor;
+  b->group = minor % SLEEPY_NL_GROUPS;
+  b->n = 0;
+  b->lost = 0;
+  INIT_DELAYED_WORK(&b->work, sleepy_nl_flush);
+}
+
+void
+sleepy_nl_batch_destroy(struct sleepy_nl_batch *b)
+{
+  cancel_delayed_work_sync(&b->work);
+}
+
+void
+sleepy_nl_event(struct sleepy_nl_batch *b, int type, unsigned int chan,
+		s32 arg, u64 value)
+{
+  struct sleepy_event ev;
+
+  if (!sleepy_nl_registered ||
+      !genl_has_listeners(&sleepy_nl_family, &init_net, b->group))
+    return;
+
+  ev.time_ns = ktime_get_ns();
+  ev.value = value;
+  ev.pid = current->pid;
+  ev.chan = chan;
+  ev.minor = b->minor;
+  ev.type = type;
+  ev.arg = arg;
+
+  spin_lock(&b->lock);
+  if (b->n == SLEEPY_NL_BATCH) {
+    b->lost++;
+  } else {
+    b->events[b->n++] = ev;
+    if (b->n == 1)
+      schedule_delayed_work(&b->work, msecs_to_jiffies(SLEEPY_NL_DELAY_MS));
+    else if (b->n == SLEEPY_NL_BATCH)
+      mod_delayed_work(system_wq, &b->work, 0);
+  }
+  spin_unlock(&b->lock);
+}
@@ -0,0 +1,54 @@
+/* sleepy_nl.h - generic netlink event stream of the sleepy devices
+ * (sleepy_nl.c). Events are collected per device and multicast in
+ * batches; nothing is recorded while nobody listens.
+ */
+
+#ifndef SLEEPY_NL_H_1727_INCLUDED
+#define SLEEPY_NL_H_1727_INCLUDED
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "sleepy_ioctl.h"
+
+/* Most events one message carries */
+#define SLEEPY_NL_BATCH 32
+
+/* Events of one device waiting to be sent.
+ *  lock - protects the fields below;
+ *  minor - the device;
+ *  group - multicast group its events go to;
+ *  n - events collected;
+ *  lost - events dropped because the batch was full;
+ *  work - sends the batch, a little after its first event or as soon
+ *    as it fills up;
+ *  events - the batch.
+ */
+struct sleepy_nl_batch {
+  spinlock_t lock;
+  unsigned int minor;
+  unsigned int group;
+  unsigned int n;
+  u32 lost;
+  struct delayed_work work;
+  struct sleepy_event events[SLEEPY_NL_BATCH];
+};
+
+/* Register the family; returns 0 or a negative error. */
+int sleepy_nl_init(void);
+
+/* Unregister it again; harmless if sleepy_nl_init() did not succeed. */
+void sleepy_nl_exit(void);
+
+void sleepy_nl_batch_init(struct sleepy_nl_batch *b, unsigned int minor);
+
+/* Discard what is still pending; nobody may add events any more. */
+void sleepy_nl_batch_destroy(struct sleepy_nl_batch *b);
+
+/* Record a SLEEPY_EVENT_* of the device, if anyone listens to it. Must
+ * not be called from interrupt context. */
+void sleepy_nl_event(struct sleepy_nl_batch *b, int type, unsigned int chan,
+		     s32 arg, u64 value);
+
+#endif /* SLEEPY_NL_H_1727_INCLUDED */
@@ -0,0 +1,227 @@
+/** concurrency stress harness for the sleepy module
+ **
+ ** Runs a randomized mix of open/close, read (wake) and write (sleep)
+ ** operations from many threads against every /dev/sleepyN, reports
+ ** throughput per interval and flags lost wakeups: a write that timed
+ ** out even though a read on the same minor started well inside its
+ ** sleep window.
+ **
+ ** usage: sleepy_stress [-t threads] [-n minors] [-d seconds]
+ **                      [-i interval] [-s max_sleep] [-u]
+ **   -u  periodically try to unload the module while sleepers are
+ **       parked; it must refuse with EBUSY/EWOULDBLOCK. **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define MAX_MINORS 64
+#define READ_LOG 64
+
+/* reads are only held against a timed-out write if they started this far
+ * inside its sleep window, to allow for syscall entry/exit latency */
+#define MARGIN_NS 50000000LL
+
+enum { OP_OPEN, OP_READ, OP_WRITE, OP_NOPS };
+
+static const char *op_names[OP_NOPS] = { "open", "read", "write" };
+
+struct minor_state {
+  atomic_llong read_log[READ_LOG]; /* start times of recent reads */
+  atomic_uint read_next;
+};
+
+static struct minor_state minors[MAX_MINORS];
+static int nminors = 10;
+static int max_sleep = 2;
+static atomic_int stop;
+static atomic_long ops[OP_NOPS];
+static atomic_long errors;
+static atomic_long lost_wakeups;
+static atomic_long early_wakes;
+
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+open_minor(int mn)
+{
+  char path[32];
+
+  snprintf(path, sizeof path, "/dev/sleepy%d", mn);
+  return open(path, O_RDWR);
+}
+
+/* Was there a read on 'mn' that started inside [from, to]? */
+static int
+read_in_window(int mn, long long from, long long to)
+{
+  long long t;
+  int i;
+
+  for (i = 0; i < READ_LOG; i++) {
+    t = atomic_load(&minors[mn].read_log[i]);
+    if (t >= from && t <= to)
+      return 1;
+  }
+  return 0;
+}
+
+static void
+do_read(int fd, int mn)
+{
+  unsigned int slot;
+
+  slot = atomic_fetch_add(&minors[mn].read_next, 1) % READ_LOG;
+  atomic_store(&minors[mn].read_log[slot], now_ns());
+  if (read(fd, NULL, 0) < 0)
+    atomic_fetch_add(&errors, 1);
+  atomic_fetch_add(&ops[OP_READ], 1);
+}
+
+static void
+do_write(int fd, int mn, unsigned int *seed)
+{
+  int sleep_len = rand_r(seed) % (max_sleep + 1);
+  long long start, deadline;
+  ssize_t r;
+
+  start = now_ns();
+  deadline = start + sleep_len * 1000000000LL;
+  r = write(fd, &sleep_len, sizeof sleep_len);
+  if (r < 0) {
+    atomic_fetch_add(&errors, 1);
+  } else if (r == 0 && sleep_len > 0) {
+    if (read_in_window(mn, start + MARGIN_NS, deadline - MARGIN_NS)) {
+      atomic_fetch_add(&lost_wakeups, 1);
+      fprintf(stderr, "lost wakeup on sleepy%d (sleep %ds)\n",
+	      mn, sleep_len);
+    }
+  } else if (r > 0) {
+    atomic_fetch_add(&early_wakes, 1);
+  }
+  atomic_fetch_add(&ops[OP_WRITE], 1);
+}
+
+static void *
+worker(void *arg)
+{
+  unsigned int seed = (unsigned int)(long)arg * 2654435761u;
+  int fd = -1, mn = 0, roll;
+
+  while (!atomic_load(&stop)) {
+    roll = rand_r(&seed) % 100;
+
+    /* reopen on a fresh minor now and then, and always when closed */
+    if (fd < 0 || roll < 10) {
+      if (fd >= 0)
+	close(fd);
+      mn = rand_r(&seed) % nminors;
+      fd = open_minor(mn);
+      atomic_fetch_add(&ops[OP_OPEN], 1);
+      if (fd < 0) {
+	atomic_fetch_add(&errors, 1);
+	usleep(1000);
+	continue;
+      }
+    }
+
+    /* sleepers outnumber wakers so there is always someone to wake */
+    if (roll < 30)
+      do_read(fd, mn);
+    else
+      do_write(fd, mn, &seed);
+  }
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+static void
+try_unload(void)
+{
+  if (syscall(SYS_delete_module, "sleepy", O_NONBLOCK) == 0) {
+    fprintf(stderr, "module unloaded while sleepers were parked\n");
+    atomic_fetch_add(&errors, 1);
+    atomic_store(&stop, 1);
+  } else if (errno != EBUSY && errno != EWOULDBLOCK && errno != EPERM) {
+    fprintf(stderr, "delete_module: %s\n", strerror(errno));
+  }
+}
+
+int main(int argc, char **argv) {
+  int nthreads = 64, duration = 60, interval = 5, unload = 0;
+  long prev[OP_NOPS] = { 0 }, cur;
+  pthread_t *threads;
+  int i, c, elapsed;
+
+  while ((c = getopt(argc, argv, "t:n:d:i:s:u")) != -1) {
+    switch (c) {
+    case 't': nthreads = atoi(optarg); break;
+    case 'n': nminors = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 'i': interval = atoi(optarg); break;
+    case 's': max_sleep = atoi(optarg); break;
+    case 'u': unload = 1; break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-n minors] [-d seconds] "
+	      "[-i interval] [-s max_sleep] [-u]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (nminors < 1 || nminors > MAX_MINORS || nthreads < 1 || interval < 1) {
+    fprintf(stderr, "bad arguments\n");
+    return 2;
+  }
+
+  threads = calloc(nthreads, sizeof *threads);
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)(long)(i + 1));
+
+  for (elapsed = 0; elapsed < duration && !atomic_load(&stop);
+       elapsed += interval) {
+    sleep(interval);
+    if (unload)
+      try_unload();
+
+    printf("t=%-6d", elapsed + interval);
+    for (i = 0; i < OP_NOPS; i++) {
+      cur = atomic_load(&ops[i]);
+      printf(" %s/s=%-8ld", op_names[i], (cur - prev[i]) / interval);
+      prev[i] = cur;
+    }
+    printf(" early=%ld lost=%ld errors=%ld\n", atomic_load(&early_wakes),
+	   atomic_load(&lost_wakeups), atomic_load(&errors));
+    fflush(stdout);
+  }
+
+  /* wake every minor so parked workers notice 'stop' promptly */
+  atomic_store(&stop, 1);
+  for (i = 0; i < nminors; i++) {
+    c = open_minor(i);
+    if (c >= 0) {
+      read(c, NULL, 0);
+      close(c);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  return atomic_load(&lost_wakeups) || atomic_load(&errors) ? 1 : 0;
+}
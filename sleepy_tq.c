@@ -0,0 +1,1024 @@
+/* sleepy_tq.c - timer queue device for callers with far more timeouts than
+ * threads.
+ *
+ * Every open file is an independent queue. write() submits a batch of
+ * struct sleepy_tq_entry (id, absolute CLOCK_MONOTONIC deadline), re-arming
+ * ids already present; SLEEPY_TQ_IOC_CANCEL removes one by id; read()
+ * blocks until timers have expired and returns their ids as an array of
+ * __u64. Timers live on a hierarchical timing wheel with 1 ms ticks,
+ * advanced by a work item that runs when the next one is due or the
+ * wheel next cascades, and are found by id through a hash table that
+ * grows with the queue.
+ *
+ * The same file can instead be driven through a pair of mmap()ed rings
+ * (SLEEPY_TQ_IOC_SETUP_RINGS): timeouts, waits on sleepy devices, cancels
+ * and signals are submitted as SQEs and answered with CQEs, drained either
+ * by SLEEPY_TQ_IOC_ENTER or, with SLEEPY_RING_SQPOLL, by the tick work.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+
+#include <asm/uaccess.h>
+
+#include "sleepy_ioctl.h"
+#include "sleepy_core.h"
+#include "sleepy_wheel.h"
+#include "sleepy_tq.h"
+
+/* Entries copied in from userspace at a time */
+#define SLEEPY_TQ_BATCH 16
+
+/* Hash table size: starts at 2^MIN buckets, doubled whenever the average
+ * chain passes two timers, up to 2^MAX */
+#define SLEEPY_TQ_HASH_MIN_BITS 6
+#define SLEEPY_TQ_HASH_MAX_BITS 20
+
+/* Largest submission ring; the completion ring may be twice that */
+#define SLEEPY_RING_MAX_ENTRIES 32768
+
+/* parameters */
+/* Most timers one open file may hold; further submissions get ENOSPC */
+static unsigned long sleepy_tq_max_timers = 1UL << 20;
+
+module_param(sleepy_tq_max_timers, ulong, S_IRUGO);
+/* ================================================================ */
+
+/* One timer, or one TIMEOUT or WAIT submitted through the rings.
+ *  wt - its place on the wheel, or on the expired list once due;
+ *  hnode - its place in the id hash, kept until read() or cancel;
+ *  id - caller's id (user_data for ring ops);
+ *  expired - set once it has been taken off the wheel as due;
+ *  opcode - SLEEPY_OP_* for ring ops, 0 for write() timers;
+ *  done - ring ops: set by whoever completes the op (expiry, wake or
+ *    cancel), which decides the race between them;
+ *  eng, watch - WAIT ops: the engine waited on and the registration;
+ *  tq - the queue it belongs to;
+ *  reap - ring ops completed by a wake, waiting to be freed.
+ */
+struct sleepy_tq_timer {
+  struct sleepy_wheel_timer wt;
+  struct hlist_node hnode;
+  u64 id;
+  int expired;
+  int opcode;
+  atomic_t done;
+  struct sleepy_engine *eng;
+  struct sleepy_watch watch;
+  struct sleepy_tq *tq;
+  struct list_head reap;
+};
+
+/* An open timer queue.
+ *  mutex - serializes submit, cancel and read, and guards the hash;
+ *  lock - guards the wheel and the expired list against the tick work;
+ *  readq - readers waiting for expired timers;
+ *  tick - work advancing the wheel while timers are pending;
+ *  hash, hash_bits - id lookup;
+ *  ntimers - timers held, pending or expired and unread, and ring ops;
+ *  ring, ring_size - the mmap()ed rings, once set up;
+ *  sq, cq, sq_entries, cq_entries - the arrays within them;
+ *  sqpoll - the tick work drains the SQ;
+ *  sq_idle - jiffies when the polling work last found an SQE;
+ *  inflight - ring ops whose CQE is owed (under lock);
+ *  reap - ring ops completed by a wake (under lock);
+ *  devs, ndevs - bitmap of the sleepy devices WAIT and SIGNAL ops may
+ *    use (SLEEPY_TQ_IOC_ADD_DEV), and its size in bits.
+ */
+struct sleepy_tq {
+  struct mutex mutex;
+  spinlock_t lock;
+  struct sleepy_wheel wheel;
+  struct list_head expired;
+  wait_queue_head_t readq;
+  struct delayed_work tick;
+  struct hlist_head *hash;
+  unsigned int hash_bits;
+  unsigned long ntimers;
+  struct sleepy_ring_hdr *ring;
+  size_t ring_size;
+  struct sleepy_sqe *sq;
+  struct sleepy_cqe *cq;
+  u32 sq_entries;
+  u32 cq_entries;
+  int sqpoll;
+  unsigned long sq_idle;
+  u32 inflight;
+  struct list_head reap;
+  unsigned long *devs;
+  unsigned int ndevs;
+};
+
+static struct kmem_cache *sleepy_tq_cache = NULL;
+static struct cdev sleepy_tq_cdev;
+static int sleepy_tq_registered = 0;
+/* ================================================================ */
+
+/* Current wheel tick */
+static u64
+sleepy_tq_now(void)
+{
+  return ktime_get_ns() / NSEC_PER_MSEC;
+}
+
+/* Find the write() timer ('ring' == 0) or ring op ('ring' != 0) with
+ * this id */
+static struct sleepy_tq_timer *
+sleepy_tq_lookup(struct sleepy_tq *tq, u64 id, int ring)
+{
+  struct sleepy_tq_timer *t;
+
+  hlist_for_each_entry(t, &tq->hash[hash_64(id, tq->hash_bits)], hnode)
+    if (t->id == id && !t->opcode == !ring)
+      return t;
+  return NULL;
+}
+
+/* Double the hash table once chains get long. Failing to is harmless:
+ * lookups just get slower. Called with tq->mutex held. */
+static void
+sleepy_tq_grow(struct sleepy_tq *tq)
+{
+  unsigned int bits = tq->hash_bits + 1;
+  struct hlist_head *hash;
+  struct sleepy_tq_timer *t;
+  struct hlist_node *tmp;
+  unsigned long i;
+
+  if (bits > SLEEPY_TQ_HASH_MAX_BITS || tq->ntimers < (2UL << tq->hash_bits))
+    return;
+  hash = kvmalloc_array(1UL << bits, sizeof(*hash), GFP_KERNEL);
+  if (hash == NULL)
+    return;
+  for (i = 0; i < (1UL << bits); i++)
+    INIT_HLIST_HEAD(&hash[i]);
+
+  for (i = 0; i < (1UL << tq->hash_bits); i++)
+    hlist_for_each_entry_safe(t, tmp, &tq->hash[i], hnode) {
+      hlist_del(&t->hnode);
+      hlist_add_head(&t->hnode, &hash[hash_64(t->id, bits)]);
+    }
+  kvfree(tq->hash);
+  tq->hash = hash;
+  tq->hash_bits = bits;
+}
+
+/* Take a timer off the wheel or the expired list, whichever it is on.
+ * Called with tq->lock held. */
+static void
+sleepy_tq_unlink(struct sleepy_tq *tq, struct sleepy_tq_timer *t)
+{
+  if (t->expired)
+    list_del_init(&t->wt.link);
+  else
+    sleepy_wheel_del(&tq->wheel, &t->wt);
+  t->expired = 0;
+}
+
+static int
+sleepy_tq_ready(struct sleepy_tq *tq)
+{
+  int ready;
+
+  spin_lock(&tq->lock);
+  ready = !list_empty(&tq->expired);
+  spin_unlock(&tq->lock);
+  return ready;
+}
+
+/* ================================================================ */
+/* Rings */
+
+/* CQEs posted and not yet consumed */
+static u32
+sleepy_ring_cq_ready(struct sleepy_tq *tq)
+{
+  return smp_load_acquire(&tq->ring->cq_tail) - READ_ONCE(tq->ring->cq_head);
+}
+
+/* Post a CQE for an op whose slot was reserved at submission. Called with
+ * tq->lock held. */
+static void
+sleepy_ring_post(struct sleepy_tq *tq, u64 user_data, int res, u64 value)
+{
+  u32 tail = tq->ring->cq_tail;
+  struct sleepy_cqe *cqe = &tq->cq[tail & (tq->cq_entries - 1)];
+
+  cqe->user_data = user_data;
+  cqe->res = res;
+  cqe->pad = 0;
+  cqe->value = value;
+  smp_store_release(&tq->ring->cq_tail, tail + 1);
+  tq->inflight--;
+}
+
+static void
+sleepy_ring_complete(struct sleepy_tq *tq, u64 user_data, int res, u64 value)
+{
+  spin_lock(&tq->lock);
+  sleepy_ring_post(tq, user_data, res, value);
+  spin_unlock(&tq->lock);
+}
+
+/* Drop a completed ring op. Called with tq->mutex held. */
+static void
+sleepy_ring_free(struct sleepy_tq *tq, struct sleepy_tq_timer *t)
+{
+  hlist_del(&t->hnode);
+  kmem_cache_free(sleepy_tq_cache, t);
+  tq->ntimers--;
+}
+
+/* A WAIT op's device moved to a new generation. Runs under the engine
+ * lock, so it only completes the op and leaves freeing it to whoever
+ * holds tq->mutex next. */
+static int
+sleepy_ring_notify(struct sleepy_watch *w, unsigned long flag, u64 value)
+{
+  struct sleepy_tq_timer *t = container_of(w, struct sleepy_tq_timer, watch);
+  struct sleepy_tq *tq = t->tq;
+
+  if (atomic_cmpxchg(&t->done, 0, 1) != 0)
+    return 1;
+
+  spin_lock(&tq->lock);
+  // Still on the wheel unless the tick already took it off as due
+  if (!list_empty(&t->wt.link) && !t->expired)
+    sleepy_wheel_del(&tq->wheel, &t->wt);
+  sleepy_ring_post(tq, t->id, 0, value);
+  list_add_tail(&t->reap, &tq->reap);
+  spin_unlock(&tq->lock);
+
+  wake_up_interruptible(&tq->readq);
+  return 1;
+}
+
+/* Free the ops completed by wakes. Called with tq->mutex held. */
+static void
+sleepy_ring_reap(struct sleepy_tq *tq)
+{
+  struct sleepy_tq_timer *t, *tmp;
+  struct list_head reap;
+
+  INIT_LIST_HEAD(&reap);
+  spin_lock(&tq->lock);
+  list_splice_init(&tq->reap, &reap);
+  spin_unlock(&tq->lock);
+  list_for_each_entry_safe(t, tmp, &reap, reap)
+    sleepy_ring_free(tq, t);
+}
+
+/* Engine of device 'minor' for a WAIT or SIGNAL op, or NULL with *err
+ * set: only devices added with SLEEPY_TQ_IOC_ADD_DEV, which the caller
+ * could open, may be used. Called with tq->mutex held. */
+static struct sleepy_engine *
+sleepy_ring_engine(struct sleepy_tq *tq, u32 minor, int *err)
+{
+  struct sleepy_engine *eng;
+
+  if (minor >= tq->ndevs || !test_bit(minor, tq->devs)) {
+    *err = -EACCES;
+    return NULL;
+  }
+  eng = sleepy_dev_engine(minor);
+  if (eng == NULL)
+    *err = -ENODEV;
+  return eng;
+}
+
+/* Start a TIMEOUT or WAIT op. Called with tq->mutex held. */
+static void
+sleepy_ring_arm(struct sleepy_tq *tq, const struct sleepy_sqe *sqe)
+{
+  struct sleepy_engine *eng = NULL;
+  struct sleepy_tq_timer *t;
+  int err;
+
+  if (sqe->opcode == SLEEPY_OP_WAIT) {
+    eng = sleepy_ring_engine(tq, sqe->dev, &err);
+    if (eng == NULL) {
+      sleepy_ring_complete(tq, sqe->user_data, err, 0);
+      return;
+    }
+  }
+  if (sleepy_tq_lookup(tq, sqe->user_data, 1)) {
+    sleepy_ring_complete(tq, sqe->user_data, -EEXIST, 0);
+    return;
+  }
+  // Ring ops count against the same limit as write() timers
+  if (tq->ntimers >= sleepy_tq_max_timers) {
+    sleepy_ring_complete(tq, sqe->user_data, -ENOSPC, 0);
+    return;
+  }
+  t = kmem_cache_alloc(sleepy_tq_cache, GFP_KERNEL);
+  if (t == NULL) {
+    sleepy_ring_complete(tq, sqe->user_data, -ENOMEM, 0);
+    return;
+  }
+  t->id = sqe->user_data;
+  t->expired = 0;
+  t->opcode = sqe->opcode;
+  atomic_set(&t->done, 0);
+  t->eng = eng;
+  t->tq = tq;
+  INIT_LIST_HEAD(&t->wt.link);
+  INIT_LIST_HEAD(&t->watch.link);
+  t->watch.notify = sleepy_ring_notify;
+  tq->ntimers++;
+  sleepy_tq_grow(tq);
+  hlist_add_head(&t->hnode, &tq->hash[hash_64(t->id, tq->hash_bits)]);
+
+  if (eng) {
+    err = sleepy_engine_watch(eng, &t->watch);
+    if (err) {
+      sleepy_ring_free(tq, t);
+      sleepy_ring_complete(tq, sqe->user_data, err, 0);
+      return;
+    }
+  }
+
+  // A wake may have completed the op already; then there is no deadline
+  spin_lock(&tq->lock);
+  if ((!eng || sqe->arg) && !atomic_read(&t->done)) {
+    t->wt.expires = DIV_ROUND_UP_ULL(sqe->arg, NSEC_PER_MSEC);
+    sleepy_wheel_add(&tq->wheel, &t->wt);
+  }
+  spin_unlock(&tq->lock);
+}
+
+/* Cancel the op 'sqe->arg'. Called with tq->mutex held. */
+static void
+sleepy_ring_cancel(struct sleepy_tq *tq, const struct sleepy_sqe *sqe)
+{
+  struct sleepy_tq_timer *t = sleepy_tq_lookup(tq, sqe->arg, 1);
+
+  if (t == NULL) {
+    sleepy_ring_complete(tq, sqe->user_data, -ENOENT, 0);
+    return;
+  }
+  if (atomic_cmpxchg(&t->done, 0, 1) != 0) {
+    sleepy_ring_complete(tq, sqe->user_data, -EALREADY, 0);
+    return;
+  }
+
+  if (t->eng)
+    sleepy_engine_unwatch(t->eng, &t->watch);
+  spin_lock(&tq->lock);
+  if (!list_empty(&t->wt.link))
+    sleepy_wheel_del(&tq->wheel, &t->wt);
+  sleepy_ring_post(tq, t->id, -ECANCELED, 0);
+  sleepy_ring_post(tq, sqe->user_data, 0, 0);
+  spin_unlock(&tq->lock);
+  sleepy_ring_free(tq, t);
+}
+
+static void
+sleepy_ring_issue(struct sleepy_tq *tq, const struct sleepy_sqe *sqe)
+{
+  struct sleepy_engine *eng;
+  int err;
+
+  switch (sqe->opcode) {
+  case SLEEPY_OP_TIMEOUT:
+  case SLEEPY_OP_WAIT:
+    sleepy_ring_arm(tq, sqe);
+    break;
+
+  case SLEEPY_OP_CANCEL:
+    sleepy_ring_cancel(tq, sqe);
+    break;
+
+  case SLEEPY_OP_SIGNAL:
+    eng = sleepy_ring_engine(tq, sqe->dev, &err);
+    sleepy_ring_complete(tq, sqe->user_data,
+			 eng ? sleepy_dev_wake(sqe->dev, sqe->arg) : err, 0);
+    break;
+
+  default:
+    sleepy_ring_complete(tq, sqe->user_data, -EINVAL, 0);
+    break;
+  }
+}
+
+/* Consume up to 'max' SQEs, stopping early when their completions might
+ * not fit in the CQ. Returns the number consumed. Called with tq->mutex
+ * held. */
+static u32
+sleepy_ring_drain(struct sleepy_tq *tq, u32 max)
+{
+  struct sleepy_ring_hdr *ring = tq->ring;
+  u32 head = ring->sq_head, tail = smp_load_acquire(&ring->sq_tail);
+  struct sleepy_sqe sqe;
+  u32 n = 0;
+  int room;
+
+  while (n < max && head != tail) {
+    // Reserve the CQE before touching the SQE
+    spin_lock(&tq->lock);
+    room = tq->inflight + sleepy_ring_cq_ready(tq) < tq->cq_entries;
+    if (room)
+      tq->inflight++;
+    spin_unlock(&tq->lock);
+    if (!room)
+      break;
+
+    // Userspace may scribble on the slot while we look: take a copy
+    memcpy(&sqe, &tq->sq[head & (tq->sq_entries - 1)], sizeof(sqe));
+    smp_store_release(&ring->sq_head, ++head);
+    sleepy_ring_issue(tq, &sqe);
+    n++;
+  }
+  if (n)
+    wake_up_interruptible(&tq->readq);
+  return n;
+}
+
+/* Complete the ring ops the wheel found due. Called with tq->mutex held. */
+static void
+sleepy_ring_expire(struct sleepy_tq *tq, struct list_head *due)
+{
+  struct sleepy_tq_timer *t, *tmp;
+
+  list_for_each_entry_safe(t, tmp, due, wt.link) {
+    list_del_init(&t->wt.link);
+    // Lost the race to a wake: that completed and queued it for reaping
+    if (atomic_cmpxchg(&t->done, 0, 1) != 0)
+      continue;
+    if (t->eng)
+      sleepy_engine_unwatch(t->eng, &t->watch);
+    sleepy_ring_complete(tq, t->id, -ETIME, 0);
+    sleepy_ring_free(tq, t);
+  }
+}
+
+/* Whether the polling tick should keep going. Gives up after a second
+ * without submissions, flagging that the next one needs an ENTER. Called
+ * with tq->mutex held. */
+static int
+sleepy_ring_keep_polling(struct sleepy_tq *tq, u32 drained)
+{
+  if (!tq->sqpoll || (READ_ONCE(tq->ring->flags) & SLEEPY_RING_NEED_WAKEUP))
+    return 0;
+  if (drained || time_before(jiffies, tq->sq_idle + HZ)) {
+    if (drained)
+      tq->sq_idle = jiffies;
+    return 1;
+  }
+
+  WRITE_ONCE(tq->ring->flags, tq->ring->flags | SLEEPY_RING_NEED_WAKEUP);
+  // Pairs with userspace publishing sq_tail before checking the flag
+  smp_mb();
+  if (READ_ONCE(tq->ring->sq_tail) == tq->ring->sq_head)
+    return 0;
+  WRITE_ONCE(tq->ring->flags, tq->ring->flags & ~SLEEPY_RING_NEED_WAKEUP);
+  return 1;
+}
+
+/* ================================================================ */
+
+static void
+sleepy_tq_tick(struct work_struct *work)
+{
+  struct sleepy_tq *tq = container_of(to_delayed_work(work),
+				      struct sleepy_tq, tick);
+  struct sleepy_wheel_timer *wt, *tmp;
+  struct sleepy_tq_timer *t;
+  struct list_head due, ring_due;
+  unsigned long pending;
+  u64 next = 0, now;
+  u32 drained = 0;
+  int poll = 0;
+
+  mutex_lock(&tq->mutex);
+  if (tq->ring && tq->sqpoll &&
+      !(READ_ONCE(tq->ring->flags) & SLEEPY_RING_NEED_WAKEUP))
+    drained = sleepy_ring_drain(tq, tq->sq_entries);
+
+  INIT_LIST_HEAD(&due);
+  INIT_LIST_HEAD(&ring_due);
+  now = sleepy_tq_now();
+  spin_lock(&tq->lock);
+  sleepy_wheel_advance(&tq->wheel, now, &due);
+  list_for_each_entry_safe(wt, tmp, &due, link) {
+    t = container_of(wt, struct sleepy_tq_timer, wt);
+    t->expired = 1;
+    if (t->opcode)
+      list_move_tail(&t->wt.link, &ring_due);
+  }
+  list_splice_tail_init(&due, &tq->expired);
+  pending = tq->wheel.count;
+  if (pending)
+    next = sleepy_wheel_next(&tq->wheel);
+  spin_unlock(&tq->lock);
+
+  if (tq->ring) {
+    sleepy_ring_expire(tq, &ring_due);
+    sleepy_ring_reap(tq);
+    poll = sleepy_ring_keep_polling(tq, drained);
+  }
+  mutex_unlock(&tq->mutex);
+
+  if (waitqueue_active(&tq->readq))
+    wake_up_interruptible(&tq->readq);
+  // Polling needs every jiffy; otherwise sleep until the wheel has
+  // something to expire or cascade
+  if (poll)
+    schedule_delayed_work(&tq->tick, 1);
+  else if (pending)
+    schedule_delayed_work(&tq->tick, msecs_to_jiffies(next - now));
+}
+
+/* Allocate the rings and report their layout. Called with tq->mutex held. */
+static int
+sleepy_ring_setup(struct sleepy_tq *tq, struct sleepy_ring_params *p)
+{
+  u32 sq = p->sq_entries, cq = p->cq_entries;
+  size_t size;
+
+  if (tq->ring)
+    return -EBUSY;
+  if (sq == 0 || sq > SLEEPY_RING_MAX_ENTRIES ||
+      cq > 2 * SLEEPY_RING_MAX_ENTRIES || (p->flags & ~SLEEPY_RING_SQPOLL))
+    return -EINVAL;
+  sq = roundup_pow_of_two(sq);
+  cq = cq ? roundup_pow_of_two(cq) : 2 * sq;
+
+  p->sq_entries = sq;
+  p->cq_entries = cq;
+  p->sq_off = sizeof(struct sleepy_ring_hdr);
+  p->cq_off = p->sq_off + sq * sizeof(struct sleepy_sqe);
+  size = PAGE_ALIGN(p->cq_off + cq * sizeof(struct sleepy_cqe));
+  p->size = size;
+
+  tq->ring = vmalloc_user(size);
+  if (tq->ring == NULL)
+    return -ENOMEM;
+  tq->ring_size = size;
+  tq->sq = (void *)tq->ring + p->sq_off;
+  tq->cq = (void *)tq->ring + p->cq_off;
+  tq->sq_entries = sq;
+  tq->cq_entries = cq;
+  tq->ring->sq_mask = sq - 1;
+  tq->ring->cq_mask = cq - 1;
+  tq->sqpoll = p->flags & SLEEPY_RING_SQPOLL;
+  tq->sq_idle = jiffies;
+  return 0;
+}
+
+/* SLEEPY_TQ_IOC_ENTER */
+static long
+sleepy_ring_enter(struct sleepy_tq *tq, struct sleepy_ring_enter *e)
+{
+  u32 n;
+
+  if (mutex_lock_interruptible(&tq->mutex))
+    return -ERESTARTSYS;
+  if (tq->ring == NULL) {
+    mutex_unlock(&tq->mutex);
+    return -ENXIO;
+  }
+  n = sleepy_ring_drain(tq, e->to_submit);
+  sleepy_ring_reap(tq);
+  if (tq->sqpoll && (tq->ring->flags & SLEEPY_RING_NEED_WAKEUP)) {
+    WRITE_ONCE(tq->ring->flags, tq->ring->flags & ~SLEEPY_RING_NEED_WAKEUP);
+    tq->sq_idle = jiffies;
+    n += sleepy_ring_drain(tq, tq->sq_entries);
+    mod_delayed_work(system_wq, &tq->tick, 0);
+  }
+  mutex_unlock(&tq->mutex);
+
+  // New timeouts may be due before the tick is
+  if (n)
+    mod_delayed_work(system_wq, &tq->tick, 0);
+
+  if (e->min_complete &&
+      wait_event_interruptible(tq->readq, sleepy_ring_cq_ready(tq) >=
+			       min(e->min_complete, tq->cq_entries)) &&
+      n == 0)
+    return -ERESTARTSYS;
+  return n;
+}
+
+/* ================================================================ */
+
+static int
+sleepy_tq_open(struct inode *inode, struct file *filp)
+{
+  struct sleepy_tq *tq;
+  unsigned long i;
+
+  tq = kzalloc(sizeof(*tq), GFP_KERNEL);
+  if (tq == NULL)
+    return -ENOMEM;
+  tq->hash_bits = SLEEPY_TQ_HASH_MIN_BITS;
+  tq->hash = kvmalloc_array(1UL << tq->hash_bits, sizeof(*tq->hash),
+			    GFP_KERNEL);
+  if (tq->hash == NULL) {
+    kfree(tq);
+    return -ENOMEM;
+  }
+  for (i = 0; i < (1UL << tq->hash_bits); i++)
+    INIT_HLIST_HEAD(&tq->hash[i]);
+
+  mutex_init(&tq->mutex);
+  spin_lock_init(&tq->lock);
+  sleepy_wheel_init(&tq->wheel, sleepy_tq_now());
+  INIT_LIST_HEAD(&tq->expired);
+  init_waitqueue_head(&tq->readq);
+  INIT_DELAYED_WORK(&tq->tick, sleepy_tq_tick);
+  INIT_LIST_HEAD(&tq->reap);
+
+  filp->private_data = tq;
+  return nonseekable_open(inode, filp);
+}
+
+static int
+sleepy_tq_release(struct inode *inode, struct file *filp)
+{
+  struct sleepy_tq *tq = filp->private_data;
+  struct sleepy_tq_timer *t;
+  struct hlist_node *tmp;
+  unsigned long i;
+
+  cancel_delayed_work_sync(&tq->tick);
+  // No WAIT op may be notified once its memory is gone
+  for (i = 0; i < (1UL << tq->hash_bits); i++)
+    hlist_for_each_entry(t, &tq->hash[i], hnode)
+      if (t->eng)
+	sleepy_engine_unwatch(t->eng, &t->watch);
+  for (i = 0; i < (1UL << tq->hash_bits); i++)
+    hlist_for_each_entry_safe(t, tmp, &tq->hash[i], hnode)
+      kmem_cache_free(sleepy_tq_cache, t);
+  kvfree(tq->hash);
+  vfree(tq->ring);
+  kfree(tq->devs);
+  kfree(tq);
+  return 0;
+}
+
+/* SLEEPY_TQ_IOC_ADD_DEV: let ring ops use the sleepy device open as
+ * 'fd'. Called with tq->mutex held. */
+static int
+sleepy_tq_add_dev(struct sleepy_tq *tq, int fd)
+{
+  unsigned long *devs;
+  struct fd f;
+  int minor;
+
+  f = fdget(fd);
+  if (f.file == NULL)
+    return -EBADF;
+  minor = sleepy_file_minor(f.file);
+  fdput(f);
+  if (minor < 0)
+    return minor;
+
+  if (minor >= tq->ndevs) {
+    devs = kcalloc(BITS_TO_LONGS(minor + 1), sizeof(*devs), GFP_KERNEL);
+    if (devs == NULL)
+      return -ENOMEM;
+    if (tq->devs)
+      memcpy(devs, tq->devs, BITS_TO_LONGS(tq->ndevs) * sizeof(*devs));
+    kfree(tq->devs);
+    tq->devs = devs;
+    tq->ndevs = BITS_TO_LONGS(minor + 1) * BITS_PER_LONG;
+  }
+  __set_bit(minor, tq->devs);
+  return 0;
+}
+
+/* Arm or re-arm up to SLEEPY_TQ_BATCH timers. Returns how many entries
+ * were taken; fewer than 'n' only when the queue is full (or out of
+ * memory) and then 0 becomes the error. Called with tq->mutex held. */
+static long
+sleepy_tq_submit(struct sleepy_tq *tq, const struct sleepy_tq_entry *ent,
+		 int n)
+{
+  struct sleepy_tq_timer *timers[SLEEPY_TQ_BATCH];
+  long err = 0;
+  int i, taken;
+
+  // Find or allocate every timer first so the wheel lock is taken once
+  for (i = 0; i < n; i++) {
+    timers[i] = sleepy_tq_lookup(tq, ent[i].id, 0);
+    if (timers[i])
+      continue;
+    if (tq->ntimers >= sleepy_tq_max_timers) {
+      err = -ENOSPC;
+      break;
+    }
+    timers[i] = kmem_cache_alloc(sleepy_tq_cache, GFP_KERNEL);
+    if (timers[i] == NULL) {
+      err = -ENOMEM;
+      break;
+    }
+    timers[i]->id = ent[i].id;
+    timers[i]->expired = 0;
+    timers[i]->opcode = 0;
+    timers[i]->eng = NULL;
+    INIT_LIST_HEAD(&timers[i]->wt.link);
+    tq->ntimers++;
+    sleepy_tq_grow(tq);
+    hlist_add_head(&timers[i]->hnode,
+		   &tq->hash[hash_64(ent[i].id, tq->hash_bits)]);
+  }
+  taken = i;
+
+  spin_lock(&tq->lock);
+  for (i = 0; i < taken; i++) {
+    // A timer that is neither on the wheel nor expired is brand new
+    if (!list_empty(&timers[i]->wt.link))
+      sleepy_tq_unlink(tq, timers[i]);
+    timers[i]->wt.expires = DIV_ROUND_UP_ULL(ent[i].deadline_ns,
+					     NSEC_PER_MSEC);
+    sleepy_wheel_add(&tq->wheel, &timers[i]->wt);
+  }
+  spin_unlock(&tq->lock);
+
+  return taken ? taken : err;
+}
+
+static ssize_t
+sleepy_tq_write(struct file *filp, const char __user *buf, size_t count,
+		loff_t *f_pos)
+{
+  struct sleepy_tq *tq = filp->private_data;
+  struct sleepy_tq_entry ent[SLEEPY_TQ_BATCH];
+  size_t total = count / sizeof(ent[0]), done = 0;
+  long ret = 0;
+  int n;
+
+  // Only whole entries
+  if (count == 0 || count % sizeof(ent[0]) != 0)
+    return -EINVAL;
+
+  if (mutex_lock_interruptible(&tq->mutex))
+    return -ERESTARTSYS;
+  while (done < total) {
+    n = min_t(size_t, total - done, SLEEPY_TQ_BATCH);
+    if (copy_from_user(ent, buf + done * sizeof(ent[0]), n * sizeof(ent[0]))) {
+      ret = -EFAULT;
+      break;
+    }
+    ret = sleepy_tq_submit(tq, ent, n);
+    if (ret <= 0)
+      break;
+    done += ret;
+    if (ret < n)
+      break;
+  }
+  mutex_unlock(&tq->mutex);
+
+  // New timers may be due before the tick is: run it now, and it will
+  // work out when it is needed next
+  if (done)
+    mod_delayed_work(system_wq, &tq->tick, 0);
+
+  // Report a partial batch as such, and the error only if nothing went in
+  return done ? done * sizeof(ent[0]) : ret;
+}
+
+static ssize_t
+sleepy_tq_read(struct file *filp, char __user *buf, size_t count,
+	       loff_t *f_pos)
+{
+  struct sleepy_tq *tq = filp->private_data;
+  size_t max = count / sizeof(u64), n = 0, i;
+  struct sleepy_tq_timer *t, *tmp;
+  u64 ids[SLEEPY_TQ_BATCH];
+  struct list_head batch;
+
+  if (max == 0)
+    return -EINVAL;
+
+  INIT_LIST_HEAD(&batch);
+  for (;;) {
+    if (!sleepy_tq_ready(tq)) {
+      if (filp->f_flags & O_NONBLOCK)
+	return -EAGAIN;
+      if (wait_event_interruptible(tq->readq, sleepy_tq_ready(tq)))
+	return -ERESTARTSYS;
+    }
+
+    if (mutex_lock_interruptible(&tq->mutex))
+      return -ERESTARTSYS;
+    spin_lock(&tq->lock);
+    list_for_each_entry_safe(t, tmp, &tq->expired, wt.link) {
+      if (n == max)
+	break;
+      list_move_tail(&t->wt.link, &batch);
+      n++;
+    }
+    spin_unlock(&tq->lock);
+    if (n)
+      break;
+    // Another reader or a cancel got there first
+    mutex_unlock(&tq->mutex);
+  }
+
+  // Hand the ids out a chunk at a time. Only timers whose ids reached
+  // userspace are done with; after a fault the rest stay expired for the
+  // next read.
+  n = 0;
+  while (!list_empty(&batch)) {
+    i = 0;
+    list_for_each_entry(t, &batch, wt.link) {
+      ids[i++] = t->id;
+      if (i == SLEEPY_TQ_BATCH)
+	break;
+    }
+    if (copy_to_user(buf + n * sizeof(u64), ids, i * sizeof(u64)))
+      break;
+    n += i;
+    while (i--) {
+      t = list_first_entry(&batch, struct sleepy_tq_timer, wt.link);
+      list_del(&t->wt.link);
+      hlist_del(&t->hnode);
+      kmem_cache_free(sleepy_tq_cache, t);
+      tq->ntimers--;
+    }
+  }
+  if (!list_empty(&batch)) {
+    spin_lock(&tq->lock);
+    list_splice(&batch, &tq->expired);
+    spin_unlock(&tq->lock);
+  }
+  mutex_unlock(&tq->mutex);
+
+  return n ? n * sizeof(u64) : -EFAULT;
+}
+
+static unsigned int
+sleepy_tq_poll(struct file *filp, poll_table *wait)
+{
+  struct sleepy_tq *tq = filp->private_data;
+
+  poll_wait(filp, &tq->readq, wait);
+  if (sleepy_tq_ready(tq) || (READ_ONCE(tq->ring) && sleepy_ring_cq_ready(tq)))
+    return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+  return POLLOUT | POLLWRNORM;
+}
+
+static int
+sleepy_tq_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  struct sleepy_tq *tq = filp->private_data;
+  int err;
+
+  mutex_lock(&tq->mutex);
+  if (tq->ring == NULL)
+    err = -ENXIO;
+  else if (vma->vm_pgoff != 0 ||
+	   vma->vm_end - vma->vm_start > tq->ring_size)
+    err = -EINVAL;
+  else
+    err = remap_vmalloc_range(vma, tq->ring, 0);
+  mutex_unlock(&tq->mutex);
+  return err;
+}
+
+static long
+sleepy_tq_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct sleepy_tq *tq = filp->private_data;
+  struct sleepy_ring_params params;
+  struct sleepy_ring_enter enter;
+  struct sleepy_tq_timer *t;
+  long ret;
+  u64 id;
+
+  switch (cmd) {
+  case SLEEPY_TQ_IOC_CANCEL:
+    if (copy_from_user(&id, (u64 __user *)arg, sizeof(id)))
+      return -EFAULT;
+    if (mutex_lock_interruptible(&tq->mutex))
+      return -ERESTARTSYS;
+    t = sleepy_tq_lookup(tq, id, 0);
+    if (t == NULL) {
+      mutex_unlock(&tq->mutex);
+      return -ENOENT;
+    }
+    spin_lock(&tq->lock);
+    sleepy_tq_unlink(tq, t);
+    spin_unlock(&tq->lock);
+    hlist_del(&t->hnode);
+    kmem_cache_free(sleepy_tq_cache, t);
+    tq->ntimers--;
+    mutex_unlock(&tq->mutex);
+    return 0;
+
+  case SLEEPY_TQ_IOC_SETUP_RINGS:
+    if (copy_from_user(&params, (void __user *)arg, sizeof(params)))
+      return -EFAULT;
+    if (mutex_lock_interruptible(&tq->mutex))
+      return -ERESTARTSYS;
+    ret = sleepy_ring_setup(tq, &params);
+    mutex_unlock(&tq->mutex);
+    if (ret)
+      return ret;
+    if (tq->sqpoll)
+      mod_delayed_work(system_wq, &tq->tick, 0);
+    if (copy_to_user((void __user *)arg, &params, sizeof(params)))
+      return -EFAULT;
+    return 0;
+
+  case SLEEPY_TQ_IOC_ENTER:
+    if (copy_from_user(&enter, (void __user *)arg, sizeof(enter)))
+      return -EFAULT;
+    return sleepy_ring_enter(tq, &enter);
+
+  case SLEEPY_TQ_IOC_ADD_DEV:
+    if (mutex_lock_interruptible(&tq->mutex))
+      return -ERESTARTSYS;
+    ret = sleepy_tq_add_dev(tq, (int)arg);
+    mutex_unlock(&tq->mutex);
+    return ret;
+
+  default:
+    return -ENOTTY;
+  }
+}
+
+static struct file_operations sleepy_tq_fops = {
+  .owner =    THIS_MODULE,
+  .read =     sleepy_tq_read,
+  .write =    sleepy_tq_write,
+  .poll =     sleepy_tq_poll,
+  .mmap =     sleepy_tq_mmap,
+  .open =     sleepy_tq_open,
+  .release =  sleepy_tq_release,
+  .llseek =   no_llseek,
+  .unlocked_ioctl = sleepy_tq_ioctl,
+};
+
+/* ================================================================ */
+
+int
+sleepy_tq_init(struct class *class, dev_t devno)
+{
+  struct device *device;
+  int err;
+
+  sleepy_tq_cache = KMEM_CACHE(sleepy_tq_timer, 0);
+  if (sleepy_tq_cache == NULL)
+    return -ENOMEM;
+
+  cdev_init(&sleepy_tq_cdev, &sleepy_tq_fops);
+  sleepy_tq_cdev.owner = THIS_MODULE;
+  err = cdev_add(&sleepy_tq_cdev, devno, 1);
+  if (err) {
+    printk(KERN_WARNING "[target] Error %d while trying to add %s",
+	   err, SLEEPY_TQ_DEVICE_NAME);
+    goto fail_cache;
+  }
+
+  device = device_create(class, NULL, devno, NULL, SLEEPY_TQ_DEVICE_NAME);
+  if (IS_ERR(device)) {
+    err = PTR_ERR(device);
+    printk(KERN_WARNING "[target] Error %d while trying to create %s",
+	   err, SLEEPY_TQ_DEVICE_NAME);
+    goto fail_cdev;
+  }
+  sleepy_tq_registered = 1;
+  return 0;
+
+ fail_cdev:
+  cdev_del(&sleepy_tq_cdev);
+ fail_cache:
+  kmem_cache_destroy(sleepy_tq_cache);
+  sleepy_tq_cache = NULL;
+  return err;
+}
+
+void
+sleepy_tq_exit(struct class *class, dev_t devno)
+{
+  if (!sleepy_tq_registered)
+    return;
+  device_destroy(class, devno);
+  cdev_del(&sleepy_tq_cdev);
+  kmem_cache_destroy(sleepy_tq_cache);
+  sleepy_tq_cache = NULL;
+  sleepy_tq_registered = 0;
+}
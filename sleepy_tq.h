@@ -0,0 +1,36 @@
+/* sleepy_tq.h - the sleepy timer queue device (sleepy_tq.c), which tracks
+ * large numbers of timers per open file on a timing wheel and hands back
+ * the ids of expired ones in batches.
+ */
+
+#ifndef SLEEPY_TQ_H_1727_INCLUDED
+#define SLEEPY_TQ_H_1727_INCLUDED
+
+#include <linux/types.h>
+#include <linux/device.h>
+
+#define SLEEPY_TQ_DEVICE_NAME "sleepytq"
+
+/* Register the device on 'devno' in 'class'. */
+int sleepy_tq_init(struct class *class, dev_t devno);
+
+/* Remove the device again; harmless if sleepy_tq_init() did not succeed. */
+void sleepy_tq_exit(struct class *class, dev_t devno);
+
+struct sleepy_engine;
+
+/* Engine of /dev/sleepy'minor', or NULL if there is no such device
+ * (sleepy_dev.c) */
+struct sleepy_engine *sleepy_dev_engine(unsigned int minor);
+
+/* Wake /dev/sleepy'minor' with 'value' as read() would, and report it on
+ * the event stream. Returns 0 or a negative errno (sleepy_dev.c) */
+int sleepy_dev_wake(unsigned int minor, u64 value);
+
+struct file;
+
+/* Minor of the sleepy device open as 'filp', or -EBADF if it is not one
+ * (sleepy_dev.c) */
+int sleepy_file_minor(struct file *filp);
+
+#endif /* SLEEPY_TQ_H_1727_INCLUDED */
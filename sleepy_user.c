@@ -0,0 +1,226 @@
+/* sleepy_user.c - futex/pthread backing for sleepy_user.h */
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sleepy_user.h"
+
+unsigned long
+sleepy_user_jiffies(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * HZ + ts.tv_nsec / (1000000000L / HZ);
+}
+
+u64
+ktime_get_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+_Thread_local struct task_struct sleepy_user_task;
+
+int
+sleepy_user_prio(void)
+{
+  pid_t tid = syscall(SYS_gettid);
+  struct sched_param param;
+  int policy = sched_getscheduler(tid);
+
+  if ((policy == SCHED_FIFO || policy == SCHED_RR) &&
+      sched_getparam(tid, &param) == 0)
+    return 99 - param.sched_priority;
+  return 120 + getpriority(PRIO_PROCESS, tid);
+}
+
+int
+sleepy_user_cpu(void)
+{
+  unsigned int cpu = 0;
+
+  syscall(SYS_getcpu, &cpu, NULL, NULL);
+  return cpu;
+}
+
+static long
+sleepy_futex(void *uaddr, int op, unsigned int val,
+	     const struct timespec *ts)
+{
+  return syscall(SYS_futex, uaddr, op, val, ts, NULL, 0);
+}
+
+static void
+sleepy_timespec(struct timespec *ts, long timeout)
+{
+  ts->tv_sec = timeout / HZ;
+  ts->tv_nsec = (timeout % HZ) * (1000000000L / HZ);
+}
+
+long
+schedule_timeout(long timeout)
+{
+  unsigned long end = jiffies + timeout;
+  struct timespec ts;
+  long left;
+
+  if (atomic_load(&current->state) != TASK_RUNNING) {
+    sleepy_timespec(&ts, timeout);
+    sleepy_futex(&current->state, FUTEX_WAIT_PRIVATE, TASK_INTERRUPTIBLE,
+		 timeout == MAX_SCHEDULE_TIMEOUT ? NULL : &ts);
+  }
+  atomic_store(&current->state, TASK_RUNNING);
+
+  if (timeout == MAX_SCHEDULE_TIMEOUT)
+    return timeout;
+
+  left = (long)(end - jiffies);
+  return left > 0 ? left : 0;
+}
+
+int
+wake_up_process(struct task_struct *task)
+{
+  if (atomic_exchange(&task->state, TASK_RUNNING) == TASK_RUNNING)
+    return 0;
+  sleepy_futex(&task->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+  return 1;
+}
+
+void
+init_waitqueue_head(wait_queue_head_t *wq)
+{
+  pthread_mutex_init(&wq->lock, NULL);
+  INIT_LIST_HEAD(&wq->tasks);
+}
+
+void
+wake_up_interruptible(wait_queue_head_t *wq)
+{
+  struct sleepy_user_wq_entry *entry;
+
+  pthread_mutex_lock(&wq->lock);
+  list_for_each_entry(entry, &wq->tasks, link)
+    wake_up_process(entry->task);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+void
+sleepy_user_wq_add(wait_queue_head_t *wq, struct sleepy_user_wq_entry *entry)
+{
+  entry->task = current;
+  pthread_mutex_lock(&wq->lock);
+  list_add_tail(&entry->link, &wq->tasks);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+void
+sleepy_user_wq_del(wait_queue_head_t *wq, struct sleepy_user_wq_entry *entry)
+{
+  pthread_mutex_lock(&wq->lock);
+  list_del(&entry->link);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+/* ---------------------------------------------------------------- */
+
+static void *
+sleepy_hrtimer_thread(void *arg)
+{
+  struct hrtimer *timer = arg;
+  enum hrtimer_restart restart;
+  struct timespec ts;
+
+  pthread_mutex_lock(&timer->lock);
+  while (!timer->stop) {
+    if (!timer->armed) {
+      pthread_cond_wait(&timer->cond, &timer->lock);
+      continue;
+    }
+    if ((u64)timer->expires > ktime_get_ns()) {
+      ts.tv_sec = timer->expires / NSEC_PER_SEC;
+      ts.tv_nsec = timer->expires % NSEC_PER_SEC;
+      pthread_cond_timedwait(&timer->cond, &timer->lock, &ts);
+      continue;
+    }
+
+    // Run the callback unlocked so it may re-arm the timer
+    timer->armed = 0;
+    pthread_mutex_unlock(&timer->lock);
+    restart = timer->function(timer);
+    pthread_mutex_lock(&timer->lock);
+    if (restart == HRTIMER_RESTART)
+      timer->armed = 1;
+  }
+  pthread_mutex_unlock(&timer->lock);
+  return NULL;
+}
+
+void
+hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timer->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&timer->lock, NULL);
+  timer->function = NULL;
+  timer->started = 0;
+  timer->stop = 0;
+  timer->armed = 0;
+  timer->expires = 0;
+}
+
+void
+hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode)
+{
+  pthread_mutex_lock(&timer->lock);
+  timer->expires = mode == HRTIMER_MODE_REL ? ktime_get_ns() + tim : tim;
+  timer->armed = 1;
+  if (!timer->started) {
+    pthread_create(&timer->thread, NULL, sleepy_hrtimer_thread, timer);
+    timer->started = 1;
+  }
+  pthread_cond_signal(&timer->cond);
+  pthread_mutex_unlock(&timer->lock);
+}
+
+void
+hrtimer_set_expires(struct hrtimer *timer, ktime_t tim)
+{
+  pthread_mutex_lock(&timer->lock);
+  timer->expires = tim;
+  pthread_mutex_unlock(&timer->lock);
+}
+
+int
+hrtimer_cancel(struct hrtimer *timer)
+{
+  int was_armed;
+
+  pthread_mutex_lock(&timer->lock);
+  was_armed = timer->armed;
+  timer->armed = 0;
+  if (!timer->started) {
+    pthread_mutex_unlock(&timer->lock);
+    return was_armed;
+  }
+  timer->stop = 1;
+  pthread_cond_signal(&timer->cond);
+  pthread_mutex_unlock(&timer->lock);
+
+  pthread_join(timer->thread, NULL);
+  timer->started = 0;
+  timer->stop = 0;
+  return was_armed;
+}
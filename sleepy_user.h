@@ -0,0 +1,337 @@
+/* sleepy_user.h - userspace stand-ins for the kernel primitives used by
+ * the sleepy wait engine (sleepy_core.c).
+ *
+ * Only what the engine actually touches is provided: mutexes map onto
+ * pthread mutexes, wait queues onto a futex sequence word, jiffies onto
+ * CLOCK_MONOTONIC with HZ fixed at 1000, and hrtimers onto helper
+ * threads. This lets the engine be built as a plain library and driven
+ * by perf, valgrind or libFuzzer (see sleepy_bench.c and sleepy_fuzz.c).
+ */
+
+#ifndef SLEEPY_USER_H_1727_INCLUDED
+#define SLEEPY_USER_H_1727_INCLUDED
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t  s32;
+typedef int64_t  s64;
+
+#ifndef ERESTARTSYS
+#define ERESTARTSYS 512
+#endif
+
+#define KERN_WARNING ""
+#define printk(...) do { } while (0)
+
+#define BUG_ON(cond) do { if (cond) abort(); } while (0)
+
+#define READ_ONCE(x)      (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)  (*(volatile __typeof__(x) *)&(x) = (v))
+
+#define smp_rmb() atomic_thread_fence(memory_order_acquire)
+#define smp_wmb() atomic_thread_fence(memory_order_release)
+#define smp_mb()  atomic_thread_fence(memory_order_seq_cst)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+
+#define kmalloc(size, gfp)  malloc(size)
+#define kzalloc(size, gfp)  calloc(1, size)
+#define kfree(ptr)          free(ptr)
+#define kvmalloc_array(n, size, gfp) malloc((n) * (size))
+#define kvmalloc(size, gfp) malloc(size)
+#define kvfree(ptr)         free(ptr)
+#define GFP_KERNEL 0
+
+/* ---------------------------------------------------------------- */
+/* Time */
+
+#define HZ 1000
+
+#define NSEC_PER_SEC 1000000000ULL
+
+unsigned long sleepy_user_jiffies(void);
+#define jiffies sleepy_user_jiffies()
+
+u64 ktime_get_ns(void);
+#define nsecs_to_jiffies(ns) ((unsigned long)((ns) / (NSEC_PER_SEC / HZ)))
+#define div64_u64(a, b) ((a) / (b))
+#define jiffies_to_nsecs(j) ((u64)(j) * (NSEC_PER_SEC / HZ))
+
+/* ---------------------------------------------------------------- */
+/* Lists (the subset of <linux/list.h> the engine uses) */
+
+#define container_of(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct list_head {
+  struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+static inline void
+INIT_LIST_HEAD(struct list_head *list)
+{
+  list->next = list;
+  list->prev = list;
+}
+
+static inline void
+__list_add(struct list_head *entry, struct list_head *prev,
+	   struct list_head *next)
+{
+  next->prev = entry;
+  entry->next = next;
+  entry->prev = prev;
+  prev->next = entry;
+}
+
+static inline void
+list_add(struct list_head *entry, struct list_head *head)
+{
+  __list_add(entry, head, head->next);
+}
+
+static inline void
+list_add_tail(struct list_head *entry, struct list_head *head)
+{
+  __list_add(entry, head->prev, head);
+}
+
+static inline void
+list_del(struct list_head *entry)
+{
+  entry->next->prev = entry->prev;
+  entry->prev->next = entry->next;
+  entry->next = entry->prev = NULL;
+}
+
+static inline void
+list_del_init(struct list_head *entry)
+{
+  entry->next->prev = entry->prev;
+  entry->prev->next = entry->next;
+  INIT_LIST_HEAD(entry);
+}
+
+static inline int
+list_empty(const struct list_head *head)
+{
+  return head->next == head;
+}
+
+static inline void
+list_move_tail(struct list_head *entry, struct list_head *head)
+{
+  entry->next->prev = entry->prev;
+  entry->prev->next = entry->next;
+  list_add_tail(entry, head);
+}
+
+/* Move all of 'list' to the front of 'head', leaving 'list' empty */
+static inline void
+list_splice_init(struct list_head *list, struct list_head *head)
+{
+  if (list_empty(list))
+    return;
+  list->next->prev = head;
+  list->prev->next = head->next;
+  head->next->prev = list->prev;
+  head->next = list->next;
+  INIT_LIST_HEAD(list);
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(head, type, member) \
+  list_entry((head)->next, type, member)
+#define list_last_entry(head, type, member) \
+  list_entry((head)->prev, type, member)
+
+#define list_for_each_entry(pos, head, member)				\
+  for (pos = list_entry((head)->next, __typeof__(*pos), member);	\
+       &pos->member != (head);						\
+       pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member)			\
+  for (pos = list_entry((head)->next, __typeof__(*pos), member),	\
+	 n = list_entry(pos->member.next, __typeof__(*pos), member);	\
+       &pos->member != (head);						\
+       pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/* ---------------------------------------------------------------- */
+/* Tasks
+ *
+ * Each thread is its own task. A task that set itself TASK_INTERRUPTIBLE
+ * sleeps in schedule_timeout() on its state word until wake_up_process()
+ * flips it back to TASK_RUNNING.
+ */
+
+#define TASK_RUNNING       0
+#define TASK_INTERRUPTIBLE 1
+
+#define MAX_SCHEDULE_TIMEOUT LONG_MAX
+
+struct task_struct {
+  atomic_int state;
+};
+
+extern _Thread_local struct task_struct sleepy_user_task;
+#define current (&sleepy_user_task)
+
+/* Kernel-style priority of the calling thread: 0-99 for real-time
+ * (lower is more urgent), 100-139 by nice value otherwise */
+int sleepy_user_prio(void);
+
+/* No NUMA in the userspace build: every CPU is on node 0 */
+int sleepy_user_cpu(void);
+#define raw_smp_processor_id() sleepy_user_cpu()
+#define cpu_to_node(cpu) 0
+
+#define set_current_state(s)   atomic_store(&current->state, (s))
+#define __set_current_state(s) atomic_store(&current->state, (s))
+#define signal_pending(task)   0
+
+long schedule_timeout(long timeout);
+int wake_up_process(struct task_struct *task);
+
+/* ---------------------------------------------------------------- */
+/* Mutexes */
+
+struct mutex {
+  pthread_mutex_t m;
+};
+
+#define mutex_init(lock)          pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock)          pthread_mutex_lock(&(lock)->m)
+#define mutex_lock_killable(lock) (pthread_mutex_lock(&(lock)->m), 0)
+#define mutex_unlock(lock)        pthread_mutex_unlock(&(lock)->m)
+
+/* ---------------------------------------------------------------- */
+/* Spinlocks (interrupts do not exist here, so flags are unused) */
+
+typedef pthread_mutex_t spinlock_t;
+
+#define spin_lock_init(lock)  pthread_mutex_init((lock), NULL)
+#define spin_lock(lock)       pthread_mutex_lock(lock)
+#define spin_unlock(lock)     pthread_mutex_unlock(lock)
+#define spin_lock_irqsave(lock, flags) \
+  do { (void)(flags); pthread_mutex_lock(lock); } while (0)
+#define spin_unlock_irqrestore(lock, flags) pthread_mutex_unlock(lock)
+
+/* ---------------------------------------------------------------- */
+/* Wait queues
+ *
+ * As in the kernel, a wait queue is a list of tasks; waking it runs
+ * wake_up_process() on each of them, so a sleeper parked in
+ * wait_event_*() can also be woken directly (e.g. by a timer).
+ */
+
+typedef struct {
+  pthread_mutex_t lock;
+  struct list_head tasks;
+} wait_queue_head_t;
+
+struct sleepy_user_wq_entry {
+  struct list_head link;
+  struct task_struct *task;
+};
+
+void init_waitqueue_head(wait_queue_head_t *wq);
+void wake_up_interruptible(wait_queue_head_t *wq);
+/* Unlocked peek, with the same caveats as in the kernel */
+static inline int
+waitqueue_active(wait_queue_head_t *wq)
+{
+  return !list_empty(&wq->tasks);
+}
+
+void sleepy_user_wq_add(wait_queue_head_t *wq,
+			struct sleepy_user_wq_entry *entry);
+void sleepy_user_wq_del(wait_queue_head_t *wq,
+			struct sleepy_user_wq_entry *entry);
+
+/* Same contract as the kernel macro: 0 if the timeout elapsed with the
+ * condition still false, otherwise the remaining jiffies (at least 1).
+ * Userspace sleeps are never interrupted by signals. */
+#define wait_event_interruptible_timeout(wq, condition, timeout)	\
+  ({									\
+    struct sleepy_user_wq_entry __entry;				\
+    long __ret = (timeout);						\
+    sleepy_user_wq_add(&(wq), &__entry);				\
+    for (;;) {								\
+      set_current_state(TASK_INTERRUPTIBLE);				\
+      if (condition) {							\
+	if (__ret == 0)							\
+	  __ret = 1;							\
+	break;								\
+      }									\
+      if (__ret == 0)							\
+	break;								\
+      __ret = schedule_timeout(__ret);					\
+    }									\
+    __set_current_state(TASK_RUNNING);					\
+    sleepy_user_wq_del(&(wq), &__entry);				\
+    __ret;								\
+  })
+
+#define wait_event_interruptible(wq, condition)				\
+  ({									\
+    wait_event_interruptible_timeout(wq, condition,			\
+				     MAX_SCHEDULE_TIMEOUT);		\
+    0;									\
+  })
+
+/* ---------------------------------------------------------------- */
+/* High-resolution timers
+ *
+ * Each armed hrtimer gets a helper thread that sleeps until the expiry
+ * and runs the callback there, standing in for hardirq context. The
+ * thread is started by hrtimer_start() and stopped by hrtimer_cancel().
+ */
+
+typedef s64 ktime_t;
+
+#define ns_to_ktime(ns) ((ktime_t)(ns))
+#define ktime_to_ns(kt) ((s64)(kt))
+
+enum hrtimer_restart {
+  HRTIMER_NORESTART,
+  HRTIMER_RESTART,
+};
+
+enum hrtimer_mode {
+  HRTIMER_MODE_ABS,
+  HRTIMER_MODE_REL,
+};
+
+struct hrtimer {
+  enum hrtimer_restart (*function)(struct hrtimer *);
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int started;
+  int stop;
+  int armed;
+  ktime_t expires;
+};
+
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t tim,
+		   enum hrtimer_mode mode);
+void hrtimer_set_expires(struct hrtimer *timer, ktime_t tim);
+int hrtimer_cancel(struct hrtimer *timer);
+
+#endif /* SLEEPY_USER_H_1727_INCLUDED */
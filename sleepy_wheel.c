@@ -0,0 +1,140 @@
+/* sleepy_wheel.c - hierarchical timing wheel. See sleepy_wheel.h.
+ *
+ * This is the classic cascading wheel: a timer is filed in the finest
+ * level whose span covers its distance from 'now', and each time level 0
+ * wraps, the next slot of level 1 is re-filed into level 0 (and so on up
+ * the levels when they wrap in turn).
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#endif
+
+#include "sleepy_wheel.h"
+
+#define L0_MASK (SLEEPY_WHEEL_L0_SLOTS - 1)
+#define LN_MASK (SLEEPY_WHEEL_LN_SLOTS - 1)
+
+/* Shift that turns a tick into a slot index at coarse level 'level' */
+#define LN_SHIFT(level) (SLEEPY_WHEEL_L0_BITS + (level) * SLEEPY_WHEEL_LN_BITS)
+
+void
+sleepy_wheel_init(struct sleepy_wheel *wh, u64 now)
+{
+  int i, j;
+
+  wh->now = now;
+  wh->count = 0;
+  for (i = 0; i < SLEEPY_WHEEL_L0_SLOTS; i++)
+    INIT_LIST_HEAD(&wh->l0[i]);
+  for (i = 0; i < SLEEPY_WHEEL_LEVELS; i++)
+    for (j = 0; j < SLEEPY_WHEEL_LN_SLOTS; j++)
+      INIT_LIST_HEAD(&wh->ln[i][j]);
+}
+
+void
+sleepy_wheel_add(struct sleepy_wheel *wh, struct sleepy_wheel_timer *t)
+{
+  u64 expires = t->expires;
+  struct list_head *slot;
+  u64 delta;
+  int level;
+
+  wh->count++;
+
+  // Already due: run it with the next tick
+  if (expires < wh->now) {
+    list_add_tail(&t->link, &wh->l0[wh->now & L0_MASK]);
+    return;
+  }
+
+  delta = expires - wh->now;
+  if (delta < SLEEPY_WHEEL_L0_SLOTS) {
+    list_add_tail(&t->link, &wh->l0[expires & L0_MASK]);
+    return;
+  }
+
+  // Too far out for the wheel: park it at the horizon, keeping its real
+  // deadline so it is re-filed correctly when cascaded
+  if (delta > SLEEPY_WHEEL_MAX_DELTA)
+    expires = wh->now + SLEEPY_WHEEL_MAX_DELTA;
+  delta = expires - wh->now;
+
+  for (level = 0; level < SLEEPY_WHEEL_LEVELS - 1; level++)
+    if (delta < 1ULL << LN_SHIFT(level + 1))
+      break;
+  slot = &wh->ln[level][(expires >> LN_SHIFT(level)) & LN_MASK];
+  list_add_tail(&t->link, slot);
+}
+
+void
+sleepy_wheel_del(struct sleepy_wheel *wh, struct sleepy_wheel_timer *t)
+{
+  list_del_init(&t->link);
+  wh->count--;
+}
+
+/* Re-file every timer of one coarse slot. Returns the slot index so the
+ * caller knows whether this level wrapped too. */
+static unsigned int
+sleepy_wheel_cascade(struct sleepy_wheel *wh, int level)
+{
+  unsigned int idx = (wh->now >> LN_SHIFT(level)) & LN_MASK;
+  struct sleepy_wheel_timer *t, *tmp;
+  struct list_head moving;
+
+  INIT_LIST_HEAD(&moving);
+  list_splice_init(&wh->ln[level][idx], &moving);
+  list_for_each_entry_safe(t, tmp, &moving, link) {
+    list_del(&t->link);
+    wh->count--;
+    sleepy_wheel_add(wh, t);
+  }
+  return idx;
+}
+
+u64
+sleepy_wheel_next(const struct sleepy_wheel *wh)
+{
+  u64 wrap = (wh->now | L0_MASK) + 1;
+  u64 t;
+
+  // A cascade is due before anything else can be
+  if ((wh->now & L0_MASK) == 0)
+    return wh->now;
+
+  // Up to the wrap, level-0 slots hold this rotation's timers only
+  for (t = wh->now; t < wrap; t++)
+    if (!list_empty(&wh->l0[t & L0_MASK]))
+      return t;
+  return wrap;
+}
+
+void
+sleepy_wheel_advance(struct sleepy_wheel *wh, u64 now,
+		     struct list_head *expired)
+{
+  struct sleepy_wheel_timer *t, *tmp;
+  unsigned int idx;
+  int level;
+
+  while (wh->now <= now) {
+    // Nothing left to find: jump straight to the target
+    if (wh->count == 0) {
+      wh->now = now + 1;
+      break;
+    }
+
+    idx = wh->now & L0_MASK;
+    if (idx == 0)
+      for (level = 0; level < SLEEPY_WHEEL_LEVELS; level++)
+	if (sleepy_wheel_cascade(wh, level) != 0)
+	  break;
+
+    list_for_each_entry_safe(t, tmp, &wh->l0[idx], link) {
+      list_move_tail(&t->link, expired);
+      wh->count--;
+    }
+    wh->now++;
+  }
+}
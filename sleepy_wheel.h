@@ -0,0 +1,77 @@
+/* sleepy_wheel.h - hierarchical timing wheel behind the sleepy timer
+ * queue device (sleepy_tq.c).
+ *
+ * Time is counted in ticks. Level 0 has one slot per tick for the next
+ * SLEEPY_WHEEL_L0_SLOTS ticks; each further level covers 64 times the
+ * span of the one below it with the same 64 slots, and its timers are
+ * cascaded down a level whenever the level below wraps. Insert and cancel
+ * are O(1); advancing is O(1) per tick plus the timers that move, and
+ * sleepy_wheel_next() tells how many idle ticks can be skipped.
+ * Like the engine, the wheel builds in userspace too.
+ */
+
+#ifndef SLEEPY_WHEEL_H_1727_INCLUDED
+#define SLEEPY_WHEEL_H_1727_INCLUDED
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/list.h>
+#else
+#include "sleepy_user.h"
+#endif
+
+#define SLEEPY_WHEEL_L0_BITS  8
+#define SLEEPY_WHEEL_LN_BITS  6
+#define SLEEPY_WHEEL_LEVELS   4 /* above level 0 */
+#define SLEEPY_WHEEL_L0_SLOTS (1 << SLEEPY_WHEEL_L0_BITS)
+#define SLEEPY_WHEEL_LN_SLOTS (1 << SLEEPY_WHEEL_LN_BITS)
+
+/* Furthest a timer can be placed; later ones are parked at this distance
+ * and re-filed as the wheel catches up (about 49 days of 1 ms ticks) */
+#define SLEEPY_WHEEL_MAX_DELTA \
+  ((1ULL << (SLEEPY_WHEEL_L0_BITS + \
+	     SLEEPY_WHEEL_LEVELS * SLEEPY_WHEEL_LN_BITS)) - 1)
+
+/* A timer on the wheel; embed it in whatever is being timed.
+ *  link - position in a wheel slot (or wherever its owner puts it
+ *    after expiry);
+ *  expires - tick at which the timer is due.
+ */
+struct sleepy_wheel_timer {
+  struct list_head link;
+  u64 expires;
+};
+
+/* The wheel.
+ *  now - next tick to be processed (ticks before it are done);
+ *  count - timers on the wheel;
+ *  l0 - one slot per tick;
+ *  ln - coarser levels, 64 slots each.
+ */
+struct sleepy_wheel {
+  u64 now;
+  unsigned long count;
+  struct list_head l0[SLEEPY_WHEEL_L0_SLOTS];
+  struct list_head ln[SLEEPY_WHEEL_LEVELS][SLEEPY_WHEEL_LN_SLOTS];
+};
+
+void sleepy_wheel_init(struct sleepy_wheel *wh, u64 now);
+
+/* File 't' by t->expires. A timer already due expires on the next
+ * advance. */
+void sleepy_wheel_add(struct sleepy_wheel *wh, struct sleepy_wheel_timer *t);
+
+/* Take a pending timer off the wheel */
+void sleepy_wheel_del(struct sleepy_wheel *wh, struct sleepy_wheel_timer *t);
+
+/* First tick at which sleepy_wheel_advance() has anything to do: the
+ * next non-empty level-0 slot, or the next cascade if that comes first.
+ * Only meaningful while timers are pending. */
+u64 sleepy_wheel_next(const struct sleepy_wheel *wh);
+
+/* Process every tick up to and including 'now', moving the timers that
+ * fall due onto the tail of 'expired' in expiry order. */
+void sleepy_wheel_advance(struct sleepy_wheel *wh, u64 now,
+			  struct list_head *expired);
+
+#endif /* SLEEPY_WHEEL_H_1727_INCLUDED */